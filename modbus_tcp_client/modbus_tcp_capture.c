@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "modbus_tcp_client.h"
+#include "modbus_tcp_private.h"
+
+/*
+ * Wire capture
+ *
+ * Every send and receive of a client is copied into a ring the pollers and
+ * blocking callers only append to. A writer thread drains it to the file, so
+ * the polling threads never wait on disk. When the ring is full the record is
+ * dropped and counted instead.
+ *
+ * File : modbus_tcp_capture_file_header_t, then for every record a
+ * modbus_tcp_capture_record_t followed by length bytes, in host byte order.
+ */
+
+#define RECORD_ALIGN 16
+#define SLOT_EMPTY 0
+#define SLOT_RECORD 1
+#define SLOT_PADDING 2
+
+struct slot {
+	unsigned int state;
+	unsigned int size;
+	modbus_tcp_capture_record_t record;
+};
+
+struct modbus_tcp_capture {
+	FILE* file;
+	unsigned char* ring;
+	unsigned long long size;
+	unsigned long long reserved;
+	unsigned long long consumed;
+	unsigned long long dropped;
+	unsigned int nextConnection;
+	int stop;
+	pthread_t writer;
+};
+
+static unsigned long long monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int drain(modbus_tcp_capture* capture)
+{
+	unsigned long long consumed = capture->consumed;
+	unsigned long long reserved = __atomic_load_n(&capture->reserved, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	while (consumed != reserved) {
+		struct slot* slot = (struct slot*)(capture->ring + (consumed & (capture->size - 1)));
+		unsigned int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		unsigned int size;
+
+		/* reserved but still being written */
+		if (state == SLOT_EMPTY) break;
+
+		size = slot->size;
+
+		if (state == SLOT_RECORD) {
+			fwrite(&slot->record, sizeof(slot->record) + slot->record.length, 1, capture->file);
+			count++;
+		}
+
+		/* a later lap may put a slot header anywhere in this span, stale bytes must not read as a finished slot */
+		memset(slot, 0, size);
+		consumed += size;
+		__atomic_store_n(&capture->consumed, consumed, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+static void* writer(void* arg)
+{
+	modbus_tcp_capture* capture = arg;
+
+	while (!__atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE)) {
+		if (drain(capture) == 0) {
+			fflush(capture->file);
+			usleep(1000);
+		}
+	}
+
+	drain(capture);
+
+	return NULL;
+}
+
+modbus_tcp_capture* modbus_tcp_capture_open(const char* path, unsigned int ring_bytes)
+{
+	struct modbus_tcp_capture* capture = calloc(1, sizeof(struct modbus_tcp_capture));
+	modbus_tcp_capture_file_header_t header;
+	struct timespec now;
+	unsigned long long size = 4096;
+
+	if (!capture) return NULL;
+
+	while (size < ring_bytes) {
+		size <<= 1;
+	}
+
+	capture->size = size;
+	capture->ring = calloc(1, size);
+	capture->file = fopen(path, "wb");
+	if (!capture->ring || !capture->file) {
+		goto do_free;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODBUS_TCP_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = MODBUS_TCP_CAPTURE_VERSION;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.realtime_nsec = (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+	header.monotonic_nsec = monotonic_nsec();
+	fwrite(&header, sizeof(header), 1, capture->file);
+
+	if (pthread_create(&capture->writer, NULL, writer, capture) != 0) {
+		goto do_free;
+	}
+
+	return capture;
+
+do_free:
+	if (capture->file) {
+		fclose(capture->file);
+	}
+	free(capture->ring);
+	free(capture);
+	return NULL;
+}
+
+int modbus_tcp_capture_close(modbus_tcp_capture* capture)
+{
+	if (!capture) return -1;
+
+	__atomic_store_n(&capture->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(capture->writer, NULL);
+
+	fclose(capture->file);
+	free(capture->ring);
+	free(capture);
+
+	return 0;
+}
+
+unsigned long long modbus_tcp_capture_dropped(modbus_tcp_capture* capture)
+{
+	return __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED);
+}
+
+unsigned int modbus_tcp_client_set_capture(modbus_tcp_client* client, modbus_tcp_capture* capture)
+{
+	client->capture = capture;
+	client->captureConnection = 0;
+
+	if (capture) {
+		client->captureConnection = __atomic_add_fetch(&capture->nextConnection, 1, __ATOMIC_RELAXED);
+	}
+
+	return client->captureConnection;
+}
+
+/* any number of threads may append, a record that does not fit is dropped rather than waited for */
+void modbus_tcp_capture_write(modbus_tcp_capture* capture, unsigned int connection, int direction, const void* data, int length)
+{
+	unsigned long long reserved;
+	unsigned long long offset;
+	unsigned long long need;
+	unsigned int size;
+	unsigned int padding;
+	struct slot* slot;
+
+	if (length <= 0) return;
+
+	size = (sizeof(struct slot) + length + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+	if (size > capture->size / 2) {
+		__atomic_add_fetch(&capture->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	reserved = __atomic_load_n(&capture->reserved, __ATOMIC_RELAXED);
+	do {
+		offset = reserved & (capture->size - 1);
+		padding = (offset + size > capture->size) ? capture->size - offset : 0;
+		need = padding + size;
+
+		if (reserved + need - __atomic_load_n(&capture->consumed, __ATOMIC_ACQUIRE) > capture->size) {
+			__atomic_add_fetch(&capture->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&capture->reserved, &reserved, reserved + need, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if (padding) {
+		slot = (struct slot*)(capture->ring + offset);
+		slot->size = padding;
+		__atomic_store_n(&slot->state, SLOT_PADDING, __ATOMIC_RELEASE);
+		offset = 0;
+	}
+
+	slot = (struct slot*)(capture->ring + offset);
+	slot->size = size;
+	slot->record.timestamp_nsec = monotonic_nsec();
+	slot->record.connection = connection;
+	slot->record.length = length;
+	slot->record.direction = direction;
+	slot->record.reserved = 0;
+	memcpy(slot + 1, data, length);
+
+	__atomic_store_n(&slot->state, SLOT_RECORD, __ATOMIC_RELEASE);
+}
@@ -14,24 +14,18 @@
 #include <linux/sockios.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <time.h>
 
 #include "modbus_tcp_client.h"
+#include "modbus_tcp_private.h"
 
-#define MULTIBLOCK_BUFFER_SIZE 1024
-
-struct modbusTcpHeader {
-	unsigned short transaction_id;
-	unsigned short protocol_id;
-	unsigned short length;
-	unsigned char unit_id;
-	unsigned char function_code;
+struct lane {
+	int priority;
+	unsigned long long requested;
+	unsigned long long granted;
 };
 
-struct modbus_tcp_client {
-	int socket;
-	struct timeval responseTimeout;
-	unsigned short transactionId;
-};
+static __thread int threadPriority = MODBUS_TCP_PRIORITY_DEFAULT;
 
 modbus_tcp_client* modbus_tcp_client_open(char* ipAddress, unsigned short port)
 {
@@ -50,6 +44,28 @@ modbus_tcp_client* modbus_tcp_client_open(char* ipAddress, unsigned short port)
 
 	const struct timeval default_timeout = {1, 0};
 	client->responseTimeout = default_timeout;
+
+	pthread_mutex_init(&client->laneLock, NULL);
+	pthread_cond_init(&client->laneCond, NULL);
+	client->laneBusy = 0;
+	memset(client->laneWaiting, 0, sizeof(client->laneWaiting));
+	memset(client->laneStats, 0, sizeof(client->laneStats));
+
+	client->poller = NULL;
+	client->maxInflight = 1;
+	client->capture = NULL;
+	client->captureConnection = 0;
+	client->rxLength = 0;
+	memset(&client->linkStats, 0, sizeof(client->linkStats));
+	client->keepaliveUsec = 0;
+	client->lastActivityUsec = 0;
+	client->keepaliveAddress = 0;
+	memset(&client->probe, 0, sizeof(client->probe));
+
+	client->arena = NULL;
+	if (modbus_tcp_client_set_frame_limits(client, MODBUS_TCP_DEFAULT_FRAME_SIZE, MODBUS_TCP_DEFAULT_FRAME_SIZE) < 0) {
+		goto do_free;
+	}
 	
 	client->socket = socket(PF_INET, SOCK_STREAM, 0);
 	if (client->socket < 0) {
@@ -61,10 +77,16 @@ modbus_tcp_client* modbus_tcp_client_open(char* ipAddress, unsigned short port)
 		close(client->socket);
 		goto do_free;
 	} else {
+		/* requests go out in pieces, do not let nagle hold a control write behind a delayed ack */
+		int nodelay = 1;
+		setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 		return client;
 	}
 	
 do_free:
+	pthread_cond_destroy(&client->laneCond);
+	pthread_mutex_destroy(&client->laneLock);
+	free(client->arena);
 	free(client);
 	return NULL;
 }
@@ -72,46 +94,142 @@ do_free:
 int modbus_tcp_client_close(modbus_tcp_client* client)
 {
 	if (!client) return -1;
+
+	if (client->poller) {
+		modbus_tcp_poller_remove(client->poller, client);
+	}
 	
 	close(client->socket);
+	pthread_cond_destroy(&client->laneCond);
+	pthread_mutex_destroy(&client->laneLock);
+	free(client->arena);
 	free(client);
 	
 	return 0;
 }
 
-static int tcp_read(modbus_tcp_client* client, void* buffer, int length)
+int modbus_tcp_client_set_frame_limits(modbus_tcp_client* client, int max_request, int max_response)
 {
-	int socket = client->socket;
-	int remaining_length = length;
-	fd_set rfds;
-	struct timeval timeout;
-	
-	FD_ZERO(&rfds);
-	FD_SET(socket, &rfds);
-		
-	while (remaining_length > 0)
-	{
-		int chunk_length;
-		int res;
-		
-		timeout = client->responseTimeout;
-		
-		res = select(socket+1, &rfds, NULL, NULL, &timeout);
-		if (res <= 0) {
-			return -1;
-		}
-		
-		chunk_length = recv(socket, buffer, remaining_length, 0);
-		
-		if (chunk_length <= 0) {
-			return -1;
+	unsigned char* arena;
+	int max_blocks;
+	int retired_offset;
+	int i;
+
+	if (!client || client->poller) return -1;
+
+	if (max_request < MODBUS_TCP_MIN_FRAME_SIZE || max_request > MODBUS_TCP_MAX_FRAME_SIZE
+	 || max_response < MODBUS_TCP_MIN_FRAME_SIZE || max_response > MODBUS_TCP_MAX_FRAME_SIZE) {
+		return -1;
+	}
+
+	/* the stream carries on from the buffered bytes, they must not be lost or cut */
+	if (max_response < client->rxLength) return -1;
+
+	/* a 0x68 request spends at least 8 bytes per block */
+	max_blocks = (max_request - 10) / 8;
+	retired_offset = (max_request + max_response + 1) & ~1;
+
+	arena = malloc(retired_offset + MODBUS_TCP_RETIRED_SLOTS * max_blocks * sizeof(unsigned short));
+	if (!arena) return -1;
+
+	memcpy(arena + max_request, client->rxBuffer, client->rxLength);
+	free(client->arena);
+	client->arena = arena;
+	client->txSize = max_request;
+	client->rxSize = max_response;
+	client->txBuffer = arena;
+	client->rxBuffer = arena + max_request;
+
+	/* layouts retired before are forgotten, their late replies fall back to a resync */
+	client->nextRetired = 0;
+	client->maxRetiredBlocks = max_blocks;
+	for (i=0; i<MODBUS_TCP_RETIRED_SLOTS; i++) {
+		client->retired[i].numOfBlock = 0;
+		client->retired[i].readLength = (unsigned short*)(arena + retired_offset) + i * max_blocks;
+	}
+
+	return 1;
+}
+
+unsigned long long modbus_tcp_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int lane_has_priority_waiter(modbus_tcp_client* client, int priority)
+{
+	int i;
+
+	for (i=0; i<priority; i++) {
+		if (client->laneWaiting[i] > 0) {
+			return 1;
 		}
-		
-		remaining_length -= chunk_length;
-		buffer += chunk_length;
 	}
-	
-	return length;
+
+	return 0;
+}
+
+/*
+ * A caller waits until the wire is free and no caller of a more urgent class
+ * is waiting. A control request therefore waits for at most the one
+ * transaction that is already on the wire.
+ */
+static void lane_acquire(modbus_tcp_client* client, int priority, struct lane* lane)
+{
+	if (threadPriority != MODBUS_TCP_PRIORITY_DEFAULT) {
+		priority = threadPriority;
+	}
+
+	lane->priority = priority;
+	lane->requested = modbus_tcp_monotonic_usec();
+
+	pthread_mutex_lock(&client->laneLock);
+
+	client->laneWaiting[priority]++;
+	while (client->laneBusy || lane_has_priority_waiter(client, priority)) {
+		pthread_cond_wait(&client->laneCond, &client->laneLock);
+	}
+	client->laneWaiting[priority]--;
+	client->laneBusy = 1;
+
+	pthread_mutex_unlock(&client->laneLock);
+
+	lane->granted = modbus_tcp_monotonic_usec();
+}
+
+void modbus_tcp_lane_account(modbus_tcp_client* client, int priority, unsigned int wait, unsigned int latency)
+{
+	modbus_tcp_latency_stats_t* stats = &client->laneStats[priority];
+
+	pthread_mutex_lock(&client->laneLock);
+
+	stats->count++;
+	stats->wait_usec_total += wait;
+	stats->latency_usec_total += latency;
+	if (wait > stats->wait_usec_max) {
+		stats->wait_usec_max = wait;
+	}
+	if (latency > stats->latency_usec_max) {
+		stats->latency_usec_max = latency;
+	}
+
+	pthread_mutex_unlock(&client->laneLock);
+}
+
+static void lane_release(modbus_tcp_client* client, struct lane* lane)
+{
+	unsigned long long now = modbus_tcp_monotonic_usec();
+
+	modbus_tcp_lane_account(client, lane->priority, lane->granted - lane->requested, now - lane->requested);
+
+	pthread_mutex_lock(&client->laneLock);
+	client->laneBusy = 0;
+	pthread_cond_broadcast(&client->laneCond);
+	pthread_mutex_unlock(&client->laneLock);
 }
 
 static int tcp_write(modbus_tcp_client* client, void* buffer, int length)
@@ -126,6 +244,7 @@ static int tcp_write(modbus_tcp_client* client, void* buffer, int length)
 		if (chunk_length <= 0) {
 			return -1;
 		}
+		MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_SENT, buffer, chunk_length);
 		
 		remaining_length -= chunk_length;
 		buffer += chunk_length;
@@ -134,431 +253,783 @@ static int tcp_write(modbus_tcp_client* client, void* buffer, int length)
 	return length;
 }
 
-static int check_response_header(struct modbusTcpHeader request, struct modbusTcpHeader response)
+/* one recv of whatever has arrived, at most length bytes */
+static int tcp_read_some(modbus_tcp_client* client, void* buffer, int length)
 {
-	if(request.transaction_id != response.transaction_id) {
-		printf("trid mismatch. %x <-> %x\n", request.transaction_id, response.transaction_id);
-		return -1;
-	}
+	int socket = client->socket;
+	fd_set rfds;
+	struct timeval timeout = client->responseTimeout;
+	int res;
 
-	if(response.protocol_id != 0) {
-		printf("protocol error\n");
-		return -1;
-	}
+	FD_ZERO(&rfds);
+	FD_SET(socket, &rfds);
 
-	if(request.unit_id != response.unit_id) {
-		printf("unit_id mismatch\n");
+	res = select(socket+1, &rfds, NULL, NULL, &timeout);
+	if (res <= 0) {
 		return -1;
 	}
 
-	if(request.function_code != response.function_code) {
-		printf("function code mismatch\n");
+	res = recv(socket, buffer, length, 0);
+	if (res <= 0) {
 		return -1;
 	}
+	MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_RECEIVED, buffer, res);
 
-	return 1;
+	return res;
 }
 
-int modbus_tcp_read_holding_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* buffer)
+static void put16(unsigned char* p, unsigned short value)
 {
-	struct read_registers_request {
-		struct modbusTcpHeader header;
-		unsigned short addr;
-		unsigned short len;
-	} request;
-	
-	struct read_registers_response {
-		struct modbusTcpHeader header;
-		union {
-			unsigned char byte_count;
-			unsigned char exception_code;
-		};
-	} response;
-	
-	unsigned short* buffer16;
+	p[0] = value >> 8;
+	p[1] = value;
+}
+
+static unsigned short get16(const unsigned char* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/*
+ * Reads until the response of t is in the receive buffer. Bytes that arrive
+ * after it stay there for the next call. Whole frames with another trid are
+ * late replies to calls that timed out and are dropped. Bytes that can not
+ * start a frame are dropped up to the next plausible header.
+ */
+static int receive_response(modbus_tcp_client* client, modbus_tcp_transaction_t* t)
+{
+	const unsigned char* frame = client->rxBuffer;
+	int length;
+	int owned;
 	int res;
-	int i;
-	
-	request.header.transaction_id = htons(client->transactionId++);
-	request.header.protocol_id = 0;
-	request.header.length = htons(6);
-	request.header.unit_id = 1;
-	request.header.function_code = 3;
-	request.addr = htons(address);
-	request.len = htons(len);
-	
-	res = tcp_write(client, &request, sizeof(request));
-	if (res <= 0) {
-		printf("error sending request\n");
-		return -1;
+
+	for (;;) {
+		while (client->rxLength >= (int)sizeof(struct modbusTcpHeader)) {
+			owned = 0;
+			length = -1;
+			if (modbus_tcp_header_valid(frame, client->rxSize)) {
+				owned = get16(frame) == t->transaction_id;
+				if (owned) {
+					length = modbus_tcp_response_length(t, frame, client->rxLength);
+				} else {
+					length = modbus_tcp_late_length(client, frame, client->rxLength);
+				}
+			}
+
+			if (length < 0 || length > client->rxSize) {
+				res = modbus_tcp_resync(frame, client->rxLength, client->rxSize);
+				printf("stream out of step, %d bytes discarded\n", res);
+				memmove(client->rxBuffer, client->rxBuffer + res, client->rxLength - res);
+				client->rxLength -= res;
+				modbus_tcp_link_account(client, res, 0);
+				if (owned) {
+					return -1;
+				}
+				continue;
+			}
+
+			if (length == 0 || client->rxLength < length) {
+				break;
+			}
+
+			res = owned ? modbus_tcp_decode_response(t, frame, length) : 0;
+
+			memmove(client->rxBuffer, client->rxBuffer + length, client->rxLength - length);
+			client->rxLength -= length;
+
+			if (owned) {
+				return res;
+			}
+			modbus_tcp_link_account(client, 0, 1);
+		}
+
+		res = tcp_read_some(client, client->rxBuffer + client->rxLength, client->rxSize - client->rxLength);
+		if (res <= 0) {
+			printf("error reading response\n");
+			/* the reply may still come, ahead of the next call's */
+			modbus_tcp_retire(client, t);
+			return -1;
+		}
+		client->rxLength += res;
 	}
-	
-	res = tcp_read(client, &response, sizeof(struct modbusTcpHeader) + 1);
-	if (res <= 0) {
-		printf("error reading response header\n");
+}
+
+/* one request and its response through the client's frame buffers */
+static int transact(modbus_tcp_client* client, modbus_tcp_transaction_t* t)
+{
+	int length;
+	int res;
+
+	if (modbus_tcp_response_size(t) > client->rxSize) {
+		printf("response exceeds frame limit\n");
 		return -1;
 	}
-	
-	response.header.length = ntohs(response.header.length);
-	
-	res = check_response_header(request.header, response.header);
-	if(res <= 0){
-		return res;
-	}
-	
-	if (response.header.function_code == (0x80 + request.header.function_code)) {
-		printf("error response. error code = %02x\n", response.exception_code);
-		return 0;
-	}
 
-	if (response.header.length != 3 + len*2) {
-		printf("length mismatch\n");
+	length = modbus_tcp_encode_request(client, t, client->txBuffer, client->txSize);
+	if (length == 0) {
+		printf("request exceeds frame limit\n");
 		return -1;
 	}
-	
-	if (response.byte_count != len*2) {
-		printf("byte length mismatch\n");
+	if (length < 0) {
+		printf("invalid request\n");
 		return -1;
 	}
-	
-	res = tcp_read(client, buffer, len*2);
+
+	res = tcp_write(client, client->txBuffer, length);
 	if (res <= 0) {
-		printf("error reading data\n");
+		printf("error sending request\n");
 		return -1;
 	}
-	
-	buffer16 = buffer;
-	
-	for (i=0; i<len; i++) {
-		buffer16[i] = ntohs(buffer16[i]);
-	}
-	
-	return 1;
+
+	return receive_response(client, t);
 }
 
-int modbus_tcp_write_multiple_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* data)
+static int read_holding_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* buffer)
 {
-	struct write_registers_request {
-		struct modbusTcpHeader header;
-		unsigned short addr;
-		unsigned short len;
-		unsigned char byte_count;
-	} request;
-	
-	struct modbusTcpHeader responseHeader;
-	struct write_registers_response {
-		unsigned short addr;
-		unsigned short len;
-	} response;
-	
-	unsigned short* buffer16;
-	int res;
-	int i;
-	
-	request.header.transaction_id = htons(client->transactionId++);
-	request.header.protocol_id = 0;
-	request.header.length = htons(7 + len*2);
-	request.header.unit_id = 1;
-	request.header.function_code = 16;
-	request.addr = htons(address);
-	request.len = htons(len);
-	request.byte_count = len*2;
-	
-	buffer16 = data;
-	
-	for (i=0; i<len; i++) {
-		buffer16[i] = ntohs(buffer16[i]);
-	}
-	
-	res = tcp_write(client, &request, sizeof(struct modbusTcpHeader) + 5);
-	if (res <= 0) {
-		printf("error sending request\n");
+	modbus_tcp_transaction_t t;
+
+	modbus_tcp_prepare_read_holding_registers(&t, client, address, len, buffer);
+
+	return transact(client, &t);
+}
+
+static int write_multiple_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* data)
+{
+	modbus_tcp_transaction_t t;
+
+	modbus_tcp_prepare_write_multiple_registers(&t, client, address, len, data);
+
+	return transact(client, &t);
+}
+
+static int read_multiblock_registers(modbus_tcp_client* client, int num_of_block, unsigned short *addr, unsigned short *len, void* buffer)
+{
+	modbus_tcp_transaction_t t;
+
+	modbus_tcp_prepare_read_multiblock_registers(&t, client, num_of_block, addr, len, buffer);
+
+	return transact(client, &t);
+}
+
+#define TYPE_READ	0xC3C3
+#define TYPE_WRITE	0x3C3C
+
+static int read_write_multiblock_registers(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests, unsigned short* acks)
+{
+	modbus_tcp_transaction_t t;
+
+	modbus_tcp_prepare_read_write_multiblock_registers(&t, client, requests, num_of_requests, acks);
+
+	return transact(client, &t);
+}
+
+/*
+ * Builds the request of a transaction into frame with a new transaction id.
+ * Returns the frame length, 0 when it does not fit in size, -1 when the
+ * request itself is invalid.
+ */
+int modbus_tcp_encode_request(modbus_tcp_client* client, modbus_tcp_transaction_t* t, unsigned char* frame, int size)
+{
+	modbus_tcp_multiblock_request_t* requests = t->buffer;
+	const unsigned short* data16;
+	unsigned short mbap_length;
+	int length;
+	int offset;
+	int i, n;
+
+	switch (t->function_code) {
+	case 3:
+		length = 12;
+		break;
+	case 16:
+		if (t->length == 0 || t->length > 123) return -1;
+		length = 13 + t->length * 2;
+		break;
+	case 0x65:
+		if (t->num_of_block <= 0 || t->num_of_block > 255) return -1;
+		length = 9 + t->num_of_block * 4;
+		break;
+	case 0x68:
+		if (t->num_of_block <= 0 || t->num_of_block > 0xFFFF) return -1;
+		length = 10;
+		for (i=0; i<t->num_of_block; i++) {
+			length += 8;
+			if (requests[i].option == MODBUS_TCP_RW_WRITE) {
+				length += requests[i].length * 2;
+			}
+		}
+		if (length - 6 > 0xFFFF) return -1;
+		break;
+	default:
 		return -1;
 	}
-	
-	res = tcp_write(client, data, len*2);
-	if (res <= 0) {
-		printf("error sending request\n");
-		return -1;
+
+	if (length > size) {
+		return 0;
 	}
-	
-	res = tcp_read(client, &responseHeader, sizeof(responseHeader));
-	if (res <= 0) {
-		printf("error reading response header\n");
-		return -1;
+
+	t->transaction_id = client->transactionId++;
+
+	/* the id is live again, a layout still retired under it is stale */
+	for (i=0; i<MODBUS_TCP_RETIRED_SLOTS; i++) {
+		if (client->retired[i].transactionId == t->transaction_id) {
+			client->retired[i].numOfBlock = 0;
+		}
 	}
-	
-	responseHeader.length = ntohs(responseHeader.length);
-	
-	res = check_response_header(request.header, responseHeader);
-	if(res <= 0){
-		return res;
+
+	put16(frame, t->transaction_id);
+	put16(frame + 2, 0);
+	put16(frame + 4, length - 6);
+	frame[6] = 1;
+	frame[7] = t->function_code;
+
+	switch (t->function_code) {
+	case 3:
+		put16(frame + 8, t->address);
+		put16(frame + 10, t->length);
+		break;
+	case 16:
+		put16(frame + 8, t->address);
+		put16(frame + 10, t->length);
+		frame[12] = t->length * 2;
+		data16 = t->buffer;
+		for (i=0; i<t->length; i++) {
+			put16(frame + 13 + i*2, data16[i]);
+		}
+		break;
+	case 0x65:
+		/* same bytes as the blocking call, the length field goes out in host order */
+		mbap_length = 3 + t->num_of_block * 4;
+		memcpy(frame + 4, &mbap_length, sizeof(mbap_length));
+		frame[8] = t->num_of_block;
+		for (i=0; i<t->num_of_block; i++) {
+			put16(frame + 9 + i*4, t->addr[i]);
+			put16(frame + 11 + i*4, t->len[i]);
+		}
+		break;
+	case 0x68:
+		put16(frame + 8, t->num_of_block);
+		offset = 10;
+		for (i=0; i<t->num_of_block; i++) {
+			modbus_tcp_multiblock_request_t* req = &requests[i];
+
+			put16(frame + offset, req->option == MODBUS_TCP_RW_READ ? TYPE_READ : TYPE_WRITE);
+			put16(frame + offset + 2, req->page);
+			put16(frame + offset + 4, req->address);
+			put16(frame + offset + 6, req->length);
+			offset += 8;
+
+			if (req->option == MODBUS_TCP_RW_WRITE) {
+				for (n=0; n<req->length; n++) {
+					put16(frame + offset + n*2, req->buffer[n]);
+				}
+				offset += req->length * 2;
+			}
+		}
+		break;
 	}
-	
-	if (responseHeader.function_code == (0x80 + request.header.function_code)) {
-		unsigned char exception_code;
-		
-		res = tcp_read(client, &exception_code, sizeof(exception_code));
-		if (res <= 0) {
-			printf("error reading exception code\n");
-			return -1;
+
+	return length;
+}
+
+/* length of the successful response frame of a transaction */
+int modbus_tcp_response_size(modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_multiblock_request_t* requests;
+	int data_len = 0;
+	int i;
+
+	switch (t->function_code) {
+	case 3:
+		return 9 + t->length * 2;
+	case 16:
+		return 12;
+	case 0x65:
+		for (i=0; i<t->num_of_block; i++) {
+			data_len += t->len[i];
 		}
-		
-		printf("error response. error code = %02x\n", exception_code);
+		return 9 + t->num_of_block * 4 + data_len * 2;
+	case 0x68:
+		requests = t->buffer;
+		for (i=0; i<t->num_of_block; i++) {
+			data_len += 1;
+			if (requests[i].option == MODBUS_TCP_RW_READ) {
+				data_len += requests[i].length;
+			}
+		}
+		return 10 + data_len * 2;
+	default:
 		return 0;
 	}
+}
 
-	if (responseHeader.length != 6) {
-		printf("length mismatch\n");
-		return -1;
-	}
-	
-	res = tcp_read(client, &response, sizeof(response));
-	if (res <= 0) {
-		printf("error reading response header\n");
-		return -1;
+/*
+ * Length of the response frame starting at frame, from the available bytes
+ * received so far. Returns 0 when more bytes are needed to tell, -1 when it
+ * can not be framed. The length field of a 0x68 response only covers the
+ * header, its frame is found by walking the blocks of its transaction t.
+ */
+#define RETIRE_GRACE_USEC 1000000
+
+/* walks the blocks of a 0x68 response, with the layout of requests or, retired, the read lengths alone */
+static int multiblock_length(const unsigned char* frame, int available, int num_of_block,
+	const modbus_tcp_multiblock_request_t* requests, const unsigned short* read_length)
+{
+	int length;
+	int len;
+	int i;
+
+	if (available < 10) {
+		return 0;
 	}
-	
-	if (response.addr != request.addr) {
-		printf("address mismatch\n");
+	if (get16(frame + 8) != num_of_block) {
 		return -1;
 	}
-	
-	if (response.len != request.len) {
-		printf("len mismatch\n");
-		return -1;
+
+	length = 10;
+	for (i=0; i<num_of_block; i++) {
+		if (available < length + 2) {
+			return 0;
+		}
+		if (requests) {
+			len = requests[i].option == MODBUS_TCP_RW_READ ? requests[i].length : 0;
+		} else {
+			len = read_length[i];
+		}
+		/* no byte count says whether a refused read block still carries its data, the frame known ends at its ack */
+		if (len > 0 && get16(frame + length) != 0) {
+			return length + 2;
+		}
+		length += len * 2 + 2;
 	}
-	
-	return 1;
+
+	return length;
 }
 
-int modbus_tcp_read_multiblock_registers(modbus_tcp_client* client, int num_of_block, unsigned short *addr, unsigned short *len, void* buffer)
+int modbus_tcp_response_length(modbus_tcp_transaction_t* t, const unsigned char* frame, int available)
 {
-	struct modbusTcpHeader request_header;
-	struct request_block {
-		unsigned short address;
-		unsigned short length;
-	} block;
-	struct read_registers_response {
-		struct modbusTcpHeader header;
-		union {
-			unsigned char number_of_block;
-			unsigned char exception_code;
-		};
-	}response;
-	unsigned char request_buf[MULTIBLOCK_BUFFER_SIZE];
-	unsigned short request_len;
-	int block_size = sizeof(block),  response_data_len = 0;
-	int i, res;
-	unsigned short* buffer16;
-
-	memcpy(request_buf + sizeof(request_header), &num_of_block, sizeof(char));
-
-	request_header.transaction_id = htons(client->transactionId++);
-	request_header.protocol_id = 0;
-	request_header.length = 3 + block_size * num_of_block;
-	request_header.unit_id = 1;
-	request_header.function_code = 0x65;
-	memcpy(request_buf, &request_header, sizeof(request_header));
-
-	for(i = 0 ; i < num_of_block ; i++)
-	{
-		int offset = sizeof(request_header) + 1 + (i * block_size);
-		block.address = htons(addr[i]);
-		block.length = htons(len[i]);
-		
-		memcpy(request_buf + offset, &block, block_size);
-		response_data_len += len[i];
+	int length;
+
+	if (available < (int)sizeof(struct modbusTcpHeader)) {
+		return 0;
 	}
 
-	request_len = sizeof(request_header) + 1 + num_of_block * block_size;
-	res = tcp_write(client, request_buf, request_len);
-	if(res <= 0) {
-		printf("error sending request \n");
-		return -1;
+	if (frame[7] != 0x68) {
+		length = 6 + get16(frame + 4);
+		if (length < (int)sizeof(struct modbusTcpHeader)) {
+			return -1;
+		}
+		/* longer than its own transaction can answer : the length field is not to be trusted */
+		if (t && frame[7] == t->function_code && length > modbus_tcp_response_size(t)) {
+			return -1;
+		}
+		return length;
 	}
 
-	res = tcp_read(client, &response, sizeof(struct modbusTcpHeader) + 1);
-	if(res <= 0) {
-		printf("error reading response header\n");
+	if (!t || t->function_code != 0x68) {
 		return -1;
 	}
 
-	response.header.length = ntohs(response.header.length);
-	
-	res = check_response_header(request_header, response.header);
-	if(res <= 0){
-		return res;
+	return multiblock_length(frame, available, t->num_of_block, t->buffer, NULL);
+}
+
+/*
+ * Remembers the block layout of a 0x68 transaction that went out but ends
+ * without its reply (timeout, cancel), so the reply can still be framed and
+ * dropped whole when it comes late. Kept for one more response timeout and
+ * RETIRE_GRACE_USEC, a reply later than that is taken as lost.
+ */
+void modbus_tcp_retire(modbus_tcp_client* client, modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_multiblock_request_t* requests = t->buffer;
+	struct modbus_tcp_retired* retired;
+	unsigned long long timeout_usec;
+	int i;
+
+	if (t->function_code != 0x68 || t->num_of_block <= 0 || t->num_of_block > client->maxRetiredBlocks) {
+		return;
 	}
 
-	if(response.header.function_code == (0x80 + request_header.function_code)) {
-		printf("error response. error code = %02x\n", response.exception_code);
-		return 0;
+	if (t->timeout_msec) {
+		timeout_usec = (unsigned long long)t->timeout_msec * 1000;
+	} else {
+		timeout_usec = (unsigned long long)client->responseTimeout.tv_sec * 1000000 + client->responseTimeout.tv_usec;
 	}
 
-	if(response.header.length != request_header.length + 2 * response_data_len) {
-		printf("length mismatch\n");
-		return -1;
+	retired = &client->retired[client->nextRetired];
+	client->nextRetired = (client->nextRetired + 1) % MODBUS_TCP_RETIRED_SLOTS;
+
+	retired->transactionId = t->transaction_id;
+	retired->numOfBlock = t->num_of_block;
+	retired->expiresUsec = modbus_tcp_monotonic_usec() + timeout_usec + RETIRE_GRACE_USEC;
+	for (i=0; i<t->num_of_block; i++) {
+		retired->readLength[i] = requests[i].option == MODBUS_TCP_RW_READ ? requests[i].length : 0;
 	}
+}
 
-	if(response.number_of_block != num_of_block) {
-		printf("number of block mismatch\n");
-		return -1;
+/* length of a frame no transaction owns, a late 0x68 reply needs the layout its transaction left behind */
+int modbus_tcp_late_length(modbus_tcp_client* client, const unsigned char* frame, int available)
+{
+	struct modbus_tcp_retired* retired = NULL;
+	unsigned short transaction_id;
+	int length;
+	int i;
+
+	if (available < (int)sizeof(struct modbusTcpHeader) || frame[7] != 0x68) {
+		return modbus_tcp_response_length(NULL, frame, available);
+	}
+
+	transaction_id = get16(frame);
+	for (i=0; i<MODBUS_TCP_RETIRED_SLOTS; i++) {
+		if (client->retired[i].numOfBlock > 0 && client->retired[i].transactionId == transaction_id) {
+			retired = &client->retired[i];
+			break;
+		}
 	}
-	res = tcp_read(client, buffer, block_size * num_of_block);
-	res = tcp_read(client, buffer, response_data_len * 2);
-	if(res <= 0) {
-		printf("error reading data\n");
+
+	if (!retired || retired->expiresUsec < modbus_tcp_monotonic_usec()) {
 		return -1;
 	}
 
-	buffer16 = buffer;
-	for(i = 0 ; i < response_data_len; i++) {
-		buffer16[i] = ntohs(buffer16[i]);
+	length = multiblock_length(frame, available, retired->numOfBlock, NULL, retired->readLength);
+
+	/* a reply comes once, the layout is done with once it is framed */
+	if (length < 0 || (length > 0 && length <= available)) {
+		retired->numOfBlock = 0;
 	}
 
-	return 1;
+	return length;
 }
 
-#define TYPE_READ	0xC3C3
-#define TYPE_WRITE	0x3C3C
-
-int modbus_tcp_read_write_multiblock_registers(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests)
+/* a header the device could have sent : our unit, a known function and a length that fits */
+int modbus_tcp_header_valid(const unsigned char* frame, int max_length)
 {
-	struct request {
-		struct modbusTcpHeader header;
-		unsigned short num_of_requests;
-	} request, response;
+	unsigned char function_code = frame[7] & 0x7F;
+	int length = 6 + get16(frame + 4);
 
-	struct {
-		unsigned short option;
-		unsigned short page;
-		unsigned short address;
-		unsigned short length;
-	} req_block;
+	if (get16(frame + 2) != 0 || frame[6] != 1) {
+		return 0;
+	}
+	if (function_code != 3 && function_code != 16 && function_code != 0x65 && function_code != 0x68) {
+		return 0;
+	}
+	if (frame[7] & 0x80) {
+		return length == 9;
+	}
+	if (frame[7] == 0x68) {
+		return length == 10;
+	}
 
-	int byte_len = 4;
-	int res, i;
+	return length >= 9 && length <= max_length;
+}
 
-	for (i=0 ; i<num_of_requests ; i++) {
-		modbus_tcp_multiblock_request_t* req = &requests[i];
-		byte_len += sizeof(req_block);
-		if (req->option == MODBUS_TCP_RW_WRITE) {
-			byte_len += req->length * 2;
+/*
+ * Bytes to drop from a receive buffer that is out of step : up to the next
+ * plausible header, or up to where there are too few bytes left to tell.
+ */
+int modbus_tcp_resync(const unsigned char* data, int available, int max_length)
+{
+	int offset;
+
+	for (offset = 1; offset + (int)sizeof(struct modbusTcpHeader) <= available; offset++) {
+		if (modbus_tcp_header_valid(data + offset, max_length)) {
+			break;
 		}
 	}
 
-	request.header.transaction_id = htons(client->transactionId++);
-	request.header.protocol_id = 0;
-	request.header.length = htons(byte_len);
-	request.header.unit_id = 1;
-	request.header.function_code = 0x68;
-	request.num_of_requests = htons(num_of_requests);
+	return offset;
+}
 
+/* a refused write block does not stop the others, every block gets its ack */
+static int decode_read_write_multiblock(modbus_tcp_transaction_t* t, const unsigned char* frame, int length)
+{
+	modbus_tcp_multiblock_request_t* requests = t->buffer;
+	int result = MODBUS_TCP_OK;
+	int offset = 10;
+	unsigned short ack;
+	int i, n;
 
-	res = tcp_write(client, &request, sizeof(request));
-	if (res <= 0) {
-		printf("error sending request\n");
-		return -1;
+	if (get16(frame + 2) != 0 || get16(frame + 4) != 4 || frame[6] != 1 || get16(frame + 8) != t->num_of_block) {
+		printf("multi response error %d,%d,%d,%d,%d\n", get16(frame), get16(frame + 2), get16(frame + 4), frame[6], get16(frame + 8));
+		return MODBUS_TCP_ERROR;
 	}
 
-	for (i=0; i<num_of_requests; i++) {
+	for (i=0; i<t->num_of_block; i++) {
 		modbus_tcp_multiblock_request_t* req = &requests[i];
-		if (req->option == MODBUS_TCP_RW_READ) {
-			req_block.option = htons(0xC3C3);
-		} else {
-			req_block.option = htons(0x3C3C);
-		}
 
-		req_block.page = htons(req->page);
-		req_block.address = htons(req->address);
-		req_block.length = htons(req->length);
+		ack = get16(frame + offset);
+		offset += 2;
 
-		res = tcp_write(client, &req_block, sizeof(req_block));
-		if (res <= 0) {
-			printf("error sending block %d\n", i);
-			return -1;
+		if (t->acks) {
+			t->acks[i] = ack;
 		}
 
-		if (req->option == MODBUS_TCP_RW_WRITE) {
-			unsigned short buffer[req->length];
-			int n;
-
-			for (n=0; n<req->length; n++) {
-				buffer[n] = htons(req->buffer[n]);
+		if (ack != 0) {
+			/* the frame ends here, what the device sent for the blocks after it is unknown */
+			if (req->option == MODBUS_TCP_RW_READ && req->length > 0) {
+				printf("read block %d refused, later blocks unknown\n", i);
+				if (t->acks) {
+					for (n=i+1; n<t->num_of_block; n++) {
+						t->acks[n] = MODBUS_TCP_ACK_UNKNOWN;
+					}
+				}
+				return MODBUS_TCP_ERROR;
 			}
+			result = MODBUS_TCP_EXCEPTION;
+			continue;
+		}
 
-			res = tcp_write(client, &buffer, req->length * 2);
-			if (res <= 0) {
-				printf("error sending block data %d\n", i);
-				return -1;
+		if (req->option == MODBUS_TCP_RW_READ) {
+			for (n=0; n<req->length; n++) {
+				req->buffer[n] = get16(frame + offset + n*2);
 			}
+			offset += req->length * 2;
 		}
 	}
 
-	res = tcp_read(client, &response, sizeof(response));
-	if (res <= 0) {
-		printf("error reading response\n");
-		return -1;
+	if (offset != length) {
+		printf("length mismatch\n");
+		return MODBUS_TCP_ERROR;
 	}
 
-	response.header.length = ntohs(response.header.length);
-	response.num_of_requests = ntohs(response.num_of_requests);
-
-	if (response.header.transaction_id != request.header.transaction_id
-	 || response.header.protocol_id != 0
-	 || response.header.length != 4
-	 || response.header.unit_id != request.header.unit_id
-	 || response.header.function_code != request.header.function_code
-	 || response.num_of_requests != request.num_of_requests) {
-		printf("multi response error %d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n"
-		    , response.header.transaction_id
-		    , request.header.transaction_id
-		    , response.header.protocol_id
-		    , response.header.length
-		    , response.header.unit_id
-		    , request.header.unit_id
-		    , response.header.function_code
-		    , request.header.function_code
-		    , response.num_of_requests
-		    , request.num_of_requests
-		);
-		return -1;
+	return result;
+}
+
+/* checks a whole response frame against its transaction and stores the data */
+int modbus_tcp_decode_response(modbus_tcp_transaction_t* t, const unsigned char* frame, int length)
+{
+	unsigned short* buffer16 = t->buffer;
+	int data_len = 0;
+	int offset;
+	int i;
+
+	if (t->function_code == 0x68 && frame[7] == 0x68) {
+		return decode_read_write_multiblock(t, frame, length);
 	}
 
-	for (i=0 ; i<num_of_requests ; i++) {
-		modbus_tcp_multiblock_request_t* req = &requests[i];
-		unsigned short ack;
+	if (get16(frame + 2) != 0) {
+		printf("protocol error\n");
+		return MODBUS_TCP_ERROR;
+	}
 
-		res = tcp_read(client, &ack, sizeof(ack));
-		if (res <= 0) {
-			printf("error reading ack %d\n", i);
-			return -1;
-		}
+	if (frame[6] != 1) {
+		printf("unit_id mismatch\n");
+		return MODBUS_TCP_ERROR;
+	}
 
-		ack = ntohs(ack);
+	if (frame[7] == (0x80 + t->function_code) && length >= 9) {
+		t->exception_code = frame[8];
+		printf("error response. error code = %02x\n", t->exception_code);
+		return MODBUS_TCP_EXCEPTION;
+	}
 
-		if (ack != 0) {
-			return -1;
+	if (frame[7] != t->function_code) {
+		printf("function code mismatch\n");
+		return MODBUS_TCP_ERROR;
+	}
+
+	switch (t->function_code) {
+	case 3:
+		if (length != 9 + t->length * 2 || frame[8] != t->length * 2) {
+			printf("length mismatch\n");
+			return MODBUS_TCP_ERROR;
+		}
+		offset = 9;
+		data_len = t->length;
+		break;
+	case 16:
+		if (length != 12) {
+			printf("length mismatch\n");
+			return MODBUS_TCP_ERROR;
 		}
+		if (get16(frame + 8) != t->address || get16(frame + 10) != t->length) {
+			printf("address mismatch\n");
+			return MODBUS_TCP_ERROR;
+		}
+		return MODBUS_TCP_OK;
+	case 0x65:
+		for (i=0; i<t->num_of_block; i++) {
+			data_len += t->len[i];
+		}
+		if (length != 9 + t->num_of_block * 4 + data_len * 2) {
+			printf("length mismatch\n");
+			return MODBUS_TCP_ERROR;
+		}
+		if (frame[8] != t->num_of_block) {
+			printf("number of block mismatch\n");
+			return MODBUS_TCP_ERROR;
+		}
+		offset = 9 + t->num_of_block * 4;
+		break;
+	default:
+		return MODBUS_TCP_ERROR;
+	}
 
-		if (req->option == MODBUS_TCP_RW_READ) {
-			res = tcp_read(client, req->buffer, req->length * 2);
-			if (res <= 0) {
-				printf("error reading data %d\n", i);
-				return -1;
-			}
+	for (i=0; i<data_len; i++) {
+		buffer16[i] = get16(frame + offset + i*2);
+	}
+
+	return MODBUS_TCP_OK;
+}
+
+int modbus_tcp_default_priority(modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_multiblock_request_t* requests;
+	int i;
 
-			int n;
-			for (n=0 ; n<req->length ; n++) {
-				req->buffer[n] = ntohs(req->buffer[n]);
+	if (t->priority != MODBUS_TCP_PRIORITY_DEFAULT) {
+		return t->priority;
+	}
+
+	switch (t->function_code) {
+	case 16:
+		return MODBUS_TCP_PRIORITY_CONTROL;
+	case 0x65:
+		return MODBUS_TCP_PRIORITY_BULK;
+	case 0x68:
+		requests = t->buffer;
+		for (i=0; i<t->num_of_block; i++) {
+			if (requests[i].option == MODBUS_TCP_RW_WRITE) {
+				return MODBUS_TCP_PRIORITY_CONTROL;
 			}
 		}
+		return MODBUS_TCP_PRIORITY_BULK;
+	default:
+		return MODBUS_TCP_PRIORITY_NORMAL;
 	}
+}
+
+int modbus_tcp_read_holding_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* buffer)
+{
+	struct lane lane;
+	int res;
+
+	lane_acquire(client, MODBUS_TCP_PRIORITY_NORMAL, &lane);
+	res = read_holding_registers(client, address, len, buffer);
+	lane_release(client, &lane);
+
+	return res;
+}
+
+int modbus_tcp_write_multiple_registers(modbus_tcp_client* client, unsigned short address, unsigned short len, void* data)
+{
+	struct lane lane;
+	int res;
+
+	lane_acquire(client, MODBUS_TCP_PRIORITY_CONTROL, &lane);
+	res = write_multiple_registers(client, address, len, data);
+	lane_release(client, &lane);
+
+	return res;
+}
+
+int modbus_tcp_read_multiblock_registers(modbus_tcp_client* client, int num_of_block, unsigned short *addr, unsigned short *len, void* buffer)
+{
+	struct lane lane;
+	int res;
+
+	lane_acquire(client, MODBUS_TCP_PRIORITY_BULK, &lane);
+	res = read_multiblock_registers(client, num_of_block, addr, len, buffer);
+	lane_release(client, &lane);
+
+	return res;
+}
+
+int modbus_tcp_read_write_multiblock_registers(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests)
+{
+	return modbus_tcp_read_write_multiblock_registers_ack(client, requests, num_of_requests, NULL);
+}
+
+int modbus_tcp_read_write_multiblock_registers_ack(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests, unsigned short* acks)
+{
+	struct lane lane;
+	int priority = MODBUS_TCP_PRIORITY_BULK;
+	int res, i;
+
+	for (i=0; i<num_of_requests; i++) {
+		if (requests[i].option == MODBUS_TCP_RW_WRITE) {
+			priority = MODBUS_TCP_PRIORITY_CONTROL;
+			break;
+		}
+	}
+
+	lane_acquire(client, priority, &lane);
+	res = read_write_multiblock_registers(client, requests, num_of_requests, acks);
+	lane_release(client, &lane);
+
+	return res;
+}
+
+void modbus_tcp_set_thread_priority(int priority)
+{
+	if (priority < MODBUS_TCP_PRIORITY_DEFAULT || priority >= MODBUS_TCP_NUM_OF_PRIORITY) {
+		return;
+	}
+
+	threadPriority = priority;
+}
+
+int modbus_tcp_client_get_latency_stats(modbus_tcp_client* client, int priority, modbus_tcp_latency_stats_t* stats)
+{
+	if (!client || priority < 0 || priority >= MODBUS_TCP_NUM_OF_PRIORITY) return -1;
+
+	pthread_mutex_lock(&client->laneLock);
+	*stats = client->laneStats[priority];
+	pthread_mutex_unlock(&client->laneLock);
+
+	return 1;
+}
+
+void modbus_tcp_client_reset_latency_stats(modbus_tcp_client* client)
+{
+	pthread_mutex_lock(&client->laneLock);
+	memset(client->laneStats, 0, sizeof(client->laneStats));
+	pthread_mutex_unlock(&client->laneLock);
+}
+
+void modbus_tcp_link_account(modbus_tcp_client* client, int discarded, int late_replies)
+{
+	pthread_mutex_lock(&client->laneLock);
+	if (discarded) {
+		client->linkStats.resyncs++;
+		client->linkStats.discarded_bytes += discarded;
+	}
+	client->linkStats.late_replies += late_replies;
+	pthread_mutex_unlock(&client->laneLock);
+}
+
+void modbus_tcp_link_probed(modbus_tcp_client* client, modbus_tcp_transaction_t* probe)
+{
+	pthread_mutex_lock(&client->laneLock);
+	client->linkStats.probes++;
+	if (probe->result == MODBUS_TCP_OK) {
+		client->linkStats.probe_latency_usec = probe->completed_usec - probe->sent_usec;
+	} else {
+		client->linkStats.probe_failures++;
+	}
+	pthread_mutex_unlock(&client->laneLock);
+}
+
+int modbus_tcp_client_get_link_stats(modbus_tcp_client* client, modbus_tcp_link_stats_t* stats)
+{
+	if (!client) return -1;
+
+	pthread_mutex_lock(&client->laneLock);
+	*stats = client->linkStats;
+	pthread_mutex_unlock(&client->laneLock);
 
 	return 1;
 }
 
+void modbus_tcp_client_set_max_inflight(modbus_tcp_client* client, int max_inflight)
+{
+	client->maxInflight = max_inflight < 1 ? 1 : max_inflight;
+}
+
+int modbus_tcp_client_get_socket(modbus_tcp_client* client)
+{
+	return client->socket;
+}
+
 void modbus_tcp_client_set_response_timeout(modbus_tcp_client* client, unsigned short timeout_msec)
 {
 	unsigned int usec = (unsigned int)timeout_msec * 1000;
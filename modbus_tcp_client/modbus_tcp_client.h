@@ -27,10 +27,359 @@ typedef struct {
 	unsigned short* buffer;
 } modbus_tcp_multiblock_request_t;
 
+/*
+ * returns 1 when every block was carried out, 0 when the device refused some
+ * write blocks, -1 on error. A 0x68 response carries no byte count, so the
+ * response can not be followed past a refused read block : the call fails
+ * with -1.
+ */
 int modbus_tcp_read_write_multiblock_registers(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests);
+/*
+ * same, acks (num_of_requests entries) receives the device's ack per block,
+ * 0 when it was carried out. After a refused read block the call fails, the
+ * acks up to and including that block are still stored, the blocks after it
+ * get MODBUS_TCP_ACK_UNKNOWN (earlier write blocks were applied).
+ */
+#define MODBUS_TCP_ACK_UNKNOWN 0xFFFF
+int modbus_tcp_read_write_multiblock_registers_ack(modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests, unsigned short* acks);
 
 void modbus_tcp_client_set_response_timeout(modbus_tcp_client* client, unsigned short timeout_msec);
 
+/*
+ * Frame limits. Every client owns one request and one response buffer,
+ * allocated at open, all calls build and receive their frames there. A call
+ * whose request or response does not fit fails with -1 instead of growing
+ * them. Only change the limits while the client is idle and not on a poller.
+ * Bytes already received for later responses move to the new buffer, the
+ * limits fail with -1 rather than drop them.
+ */
+#define MODBUS_TCP_DEFAULT_FRAME_SIZE 8192
+#define MODBUS_TCP_MIN_FRAME_SIZE 260
+#define MODBUS_TCP_MAX_FRAME_SIZE (1 << 20)
+
+int modbus_tcp_client_set_frame_limits(modbus_tcp_client* client, int max_request, int max_response);
+
+/*
+ * Priority lanes. Calls sharing a client are serialized, and a waiting call
+ * of a more urgent class is always let onto the wire before a less urgent one.
+ * By default writes are CONTROL (0x68 batches too when they carry a write),
+ * single reads are NORMAL and multiblock reads are BULK.
+ */
+enum modbus_tcp_priority {
+	MODBUS_TCP_PRIORITY_DEFAULT = -1,
+	MODBUS_TCP_PRIORITY_CONTROL,
+	MODBUS_TCP_PRIORITY_NORMAL,
+	MODBUS_TCP_PRIORITY_BULK,
+	MODBUS_TCP_NUM_OF_PRIORITY,
+};
+
+typedef struct {
+	unsigned int count;
+	unsigned int wait_usec_max;
+	unsigned int latency_usec_max;
+	unsigned long long wait_usec_total;
+	unsigned long long latency_usec_total;
+} modbus_tcp_latency_stats_t;
+
+/* overrides the class of every call made from the calling thread, MODBUS_TCP_PRIORITY_DEFAULT restores it */
+void modbus_tcp_set_thread_priority(int priority);
+int modbus_tcp_client_get_latency_stats(modbus_tcp_client* client, int priority, modbus_tcp_latency_stats_t* stats);
+void modbus_tcp_client_reset_latency_stats(modbus_tcp_client* client);
+
+/*
+ * Link health. A response that can not be framed does not leave the stream
+ * out of step : bytes are dropped up to the next plausible MBAP header and
+ * only the request that owned the broken frame fails. Late replies to
+ * transactions that timed out or were cancelled are dropped.
+ */
+typedef struct {
+	unsigned int resyncs;
+	unsigned int late_replies;
+	unsigned long long discarded_bytes;
+	unsigned int probes;
+	unsigned int probe_failures;
+	unsigned int probe_latency_usec;
+} modbus_tcp_link_stats_t;
+
+int modbus_tcp_client_get_link_stats(modbus_tcp_client* client, modbus_tcp_link_stats_t* stats);
+
+/*
+ * Poll plans. A plan is a fixed list of blocks read with one multiblock
+ * request into a contiguous image (blocks in plan order). After every scan
+ * the image is compared with the last reported values and only the changed
+ * registers are handed out, typed values with a deadband are reported only
+ * once they move by more than the deadband.
+ */
+typedef struct modbus_tcp_poll_plan modbus_tcp_poll_plan;
+
+enum modbus_tcp_value_type {
+	MODBUS_TCP_TYPE_UINT16,
+	MODBUS_TCP_TYPE_INT16,
+	MODBUS_TCP_TYPE_UINT32,
+	MODBUS_TCP_TYPE_INT32,
+	MODBUS_TCP_TYPE_FLOAT32,
+};
+
+enum modbus_tcp_word_order {
+	MODBUS_TCP_WORD_ORDER_HIGH_FIRST,
+	MODBUS_TCP_WORD_ORDER_LOW_FIRST,
+};
+
+enum modbus_tcp_deadband_mode {
+	MODBUS_TCP_DEADBAND_ABSOLUTE,
+	MODBUS_TCP_DEADBAND_PERCENT,
+};
+
+typedef struct {
+	unsigned short address;
+	unsigned short length;
+	const unsigned short* value;
+} modbus_tcp_change_t;
+
+modbus_tcp_poll_plan* modbus_tcp_poll_plan_create(int num_of_block, unsigned short* addr, unsigned short* len);
+void modbus_tcp_poll_plan_destroy(modbus_tcp_poll_plan* plan);
+int modbus_tcp_poll_plan_set_deadband(modbus_tcp_poll_plan* plan, unsigned short address, int type, int word_order, int mode, double deadband);
+
+/* scans the plan and detects changes, returns 1 on success like the read calls */
+int modbus_tcp_poll(modbus_tcp_client* client, modbus_tcp_poll_plan* plan);
+/* detects changes after the image was filled some other way */
+int modbus_tcp_poll_plan_detect_changes(modbus_tcp_poll_plan* plan);
+int modbus_tcp_poll_plan_num_of_changes(modbus_tcp_poll_plan* plan);
+int modbus_tcp_poll_plan_next_change(modbus_tcp_poll_plan* plan, int* cursor, modbus_tcp_change_t* change);
+const unsigned short* modbus_tcp_poll_plan_image(modbus_tcp_poll_plan* plan, int* image_len);
+
+/*
+ * Non-blocking transactions. A poller drives any number of clients from one
+ * thread : transactions are submitted, sent as soon as the client's lane
+ * allows, and completed from modbus_tcp_poller_run() by calling the
+ * transaction's complete callback. Transactions are owned by the caller and
+ * must stay valid until completed. A client added to a poller must not be
+ * used with the blocking calls until it is removed again.
+ */
+typedef struct modbus_tcp_poller modbus_tcp_poller;
+typedef struct modbus_tcp_transaction modbus_tcp_transaction_t;
+
+enum modbus_tcp_result {
+	MODBUS_TCP_CANCELLED = -3,
+	MODBUS_TCP_TIMEOUT = -2,
+	MODBUS_TCP_ERROR = -1,
+	MODBUS_TCP_EXCEPTION = 0,
+	MODBUS_TCP_OK = 1,
+};
+
+struct modbus_tcp_transaction {
+	/* request */
+	modbus_tcp_client* client;
+	unsigned char function_code;
+	int priority;
+	unsigned short timeout_msec;
+	unsigned short address;
+	unsigned short length;
+	int num_of_block;
+	unsigned short* addr;
+	unsigned short* len;
+	void* buffer;
+	unsigned short* acks;
+	void (*complete)(modbus_tcp_transaction_t* transaction);
+	void* user_data;
+
+	/* result, monotonic clock in usec */
+	int result;
+	unsigned char exception_code;
+	unsigned long long submitted_usec;
+	unsigned long long sent_usec;
+	unsigned long long completed_usec;
+
+	/* owned by the poller */
+	int state;
+	int cancel_requested;
+	unsigned short transaction_id;
+	unsigned long long deadline_usec;
+	modbus_tcp_transaction_t* next;
+};
+
+void modbus_tcp_prepare_read_holding_registers(modbus_tcp_transaction_t* transaction, modbus_tcp_client* client, unsigned short address, unsigned short len, void* buffer);
+void modbus_tcp_prepare_write_multiple_registers(modbus_tcp_transaction_t* transaction, modbus_tcp_client* client, unsigned short address, unsigned short len, const void* data);
+void modbus_tcp_prepare_read_multiblock_registers(modbus_tcp_transaction_t* transaction, modbus_tcp_client* client, int num_of_block, unsigned short *addr, unsigned short *len, void* buffer);
+/* result MODBUS_TCP_EXCEPTION when the device refused some write blocks, acks (may be NULL) as for modbus_tcp_read_write_multiblock_registers_ack */
+void modbus_tcp_prepare_read_write_multiblock_registers(modbus_tcp_transaction_t* transaction, modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests, unsigned short* acks);
+/* one scan of a poll plan into image (the plan's own image when NULL), changes are detected by the caller */
+void modbus_tcp_prepare_poll_plan(modbus_tcp_transaction_t* transaction, modbus_tcp_client* client, modbus_tcp_poll_plan* plan, unsigned short* image);
+
+enum modbus_tcp_poller_backend {
+	MODBUS_TCP_POLLER_EPOLL,
+	MODBUS_TCP_POLLER_IO_URING,
+};
+
+modbus_tcp_poller* modbus_tcp_poller_create(void);
+/* io_uring falls back to epoll when the kernel or the build does not have it */
+modbus_tcp_poller* modbus_tcp_poller_create_backend(int backend);
+int modbus_tcp_poller_backend(modbus_tcp_poller* poller);
+void modbus_tcp_poller_destroy(modbus_tcp_poller* poller);
+int modbus_tcp_poller_add(modbus_tcp_poller* poller, modbus_tcp_client* client);
+int modbus_tcp_poller_remove(modbus_tcp_poller* poller, modbus_tcp_client* client);
+int modbus_tcp_poller_submit(modbus_tcp_poller* poller, modbus_tcp_transaction_t* transaction);
+int modbus_tcp_poller_cancel(modbus_tcp_poller* poller, modbus_tcp_transaction_t* transaction);
+/* the only call safe from another thread : the poller's thread cancels the transaction in its next run */
+int modbus_tcp_poller_cancel_async(modbus_tcp_poller* poller, modbus_tcp_transaction_t* transaction);
+/* waits up to timeout_msec (-1 forever) for progress, returns the number of completed transactions */
+int modbus_tcp_poller_run(modbus_tcp_poller* poller, int timeout_msec);
+int modbus_tcp_poller_pending(modbus_tcp_poller* poller);
+
+/* requests a poller keeps on the wire per client at once, 1 by default */
+void modbus_tcp_client_set_max_inflight(modbus_tcp_client* client, int max_inflight);
+/* a client idle for idle_msec on a poller reads one register at address as a probe, 0 disables (default) */
+void modbus_tcp_client_set_keepalive(modbus_tcp_client* client, unsigned short idle_msec, unsigned short address);
+int modbus_tcp_client_get_socket(modbus_tcp_client* client);
+
+/*
+ * Fleet snapshots. Every device of the list is read at the same instant :
+ * the requests of all (client, plan) pairs are submitted to one poller back
+ * to back, so a snapshot takes about one round trip plus the slowest device
+ * rather than the sum of them. Registers land in one contiguous matrix, one
+ * row of row_len registers per device in list order (plan image layout,
+ * zero padded), next to a result per device. Clients not yet on the poller
+ * are added at create and removed at destroy. The poller must not be run
+ * by another thread meanwhile, other transactions on it complete as usual.
+ */
+typedef struct modbus_tcp_snapshot modbus_tcp_snapshot;
+
+typedef struct {
+	modbus_tcp_client* client;
+	modbus_tcp_poll_plan* plan;
+} modbus_tcp_snapshot_device_t;
+
+typedef struct {
+	/* result of the read, see enum modbus_tcp_result */
+	int status;
+	unsigned char exception_code;
+	/* monotonic clock in usec, 0 when the request did not go out or no response came */
+	unsigned long long sent_usec;
+	unsigned long long received_usec;
+	unsigned long long received_realtime_nsec;
+} modbus_tcp_snapshot_result_t;
+
+/* NULL as well when a client is on another poller */
+modbus_tcp_snapshot* modbus_tcp_snapshot_create(modbus_tcp_poller* poller, const modbus_tcp_snapshot_device_t* devices, int num_of_device);
+void modbus_tcp_snapshot_destroy(modbus_tcp_snapshot* snapshot);
+/* reads every device once, timeout_msec per device (0 : client timeout), returns the number of devices read,
+ * -1 when the poller fails : the reads still outstanding are cancelled and their results say so */
+int modbus_tcp_snapshot_take(modbus_tcp_snapshot* snapshot, unsigned short timeout_msec);
+const unsigned short* modbus_tcp_snapshot_matrix(modbus_tcp_snapshot* snapshot, int* row_len);
+const modbus_tcp_snapshot_result_t* modbus_tcp_snapshot_results(modbus_tcp_snapshot* snapshot);
+
+/*
+ * Wire capture. Every byte a client sends or receives, blocking or through a
+ * poller, is recorded with a monotonic timestamp. Recording never blocks the
+ * caller : records are handed to a writer thread through a ring, and dropped
+ * (see modbus_tcp_capture_dropped) when the ring is full.
+ * modbus_tcp_replay plays a capture back as a device.
+ */
+typedef struct modbus_tcp_capture modbus_tcp_capture;
+
+#define MODBUS_TCP_CAPTURE_MAGIC "MBTCPCAP"
+#define MODBUS_TCP_CAPTURE_VERSION 1
+
+enum modbus_tcp_capture_direction {
+	MODBUS_TCP_CAPTURE_SENT,
+	MODBUS_TCP_CAPTURE_RECEIVED,
+};
+
+/* file layout, host byte order */
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int reserved;
+	unsigned long long realtime_nsec;
+	unsigned long long monotonic_nsec;
+} modbus_tcp_capture_file_header_t;
+
+typedef struct {
+	unsigned long long timestamp_nsec;
+	unsigned int connection;
+	unsigned short length;
+	unsigned char direction;
+	unsigned char reserved;
+	/* length bytes follow */
+} modbus_tcp_capture_record_t;
+
+modbus_tcp_capture* modbus_tcp_capture_open(const char* path, unsigned int ring_bytes);
+/* only once every client recording to it was set back to NULL */
+int modbus_tcp_capture_close(modbus_tcp_capture* capture);
+unsigned long long modbus_tcp_capture_dropped(modbus_tcp_capture* capture);
+/*
+ * starts recording client (NULL stops), returns the connection number its
+ * records carry. Not synchronized with the client's traffic : call it only
+ * while no thread uses the client, not during a blocking call or a run of
+ * its poller.
+ */
+unsigned int modbus_tcp_client_set_capture(modbus_tcp_client* client, modbus_tcp_capture* capture);
+
+/*
+ * Shared memory export. The polling process publishes per-device register
+ * images, scan times and client health into a POSIX shared memory segment,
+ * other processes open it read-only and read it without any Modbus traffic.
+ * Every device slot is guarded by a seqlock : the publisher never waits,
+ * a reader retries while a publish is in progress.
+ *
+ * Layout : modbus_tcp_shm_header_t, then num_of_device slots of device_size
+ * bytes, each a modbus_tcp_shm_device_t with max_registers registers at
+ * image_offset. Minor versions only append fields : readers step by
+ * header_size and device_size, find the image at image_offset and reject
+ * another major version. A restarted publisher bumps generation, readers
+ * then check the segment size again before touching it.
+ */
+typedef struct modbus_tcp_shm modbus_tcp_shm;
+
+#define MODBUS_TCP_SHM_MAGIC 0x4853424D
+#define MODBUS_TCP_SHM_VERSION_MAJOR 1
+#define MODBUS_TCP_SHM_VERSION_MINOR 0
+#define MODBUS_TCP_SHM_NAME_SIZE 32
+
+typedef struct {
+	unsigned int magic;
+	unsigned short version_major;
+	unsigned short version_minor;
+	unsigned int header_size;
+	unsigned int device_size;
+	unsigned int num_of_device;
+	unsigned int max_registers;
+	unsigned int image_offset;
+	unsigned int generation;
+	unsigned long long created_realtime_nsec;
+} modbus_tcp_shm_header_t;
+
+typedef struct {
+	unsigned int sequence;
+	int status;
+	char name[MODBUS_TCP_SHM_NAME_SIZE];
+	int image_len;
+	unsigned int scan_usec;
+	unsigned long long scan_realtime_nsec;
+	unsigned long long scan_monotonic_nsec;
+	unsigned long long scans;
+	unsigned long long errors;
+	unsigned long long exceptions;
+	unsigned int consecutive_errors;
+	unsigned int reserved;
+	modbus_tcp_latency_stats_t latency[MODBUS_TCP_NUM_OF_PRIORITY];
+} modbus_tcp_shm_device_t;
+
+/* publisher */
+modbus_tcp_shm* modbus_tcp_shm_create(const char* name, int num_of_device, int max_registers);
+void modbus_tcp_shm_destroy(modbus_tcp_shm* shm);
+int modbus_tcp_shm_set_device(modbus_tcp_shm* shm, int device, const char* name);
+/* status is the result of the scan, client (may be NULL) supplies the latency stats, scan_usec the time the scan took */
+int modbus_tcp_shm_publish(modbus_tcp_shm* shm, int device, modbus_tcp_client* client, const unsigned short* image, int image_len, int status, unsigned int scan_usec);
+
+/* reader */
+modbus_tcp_shm* modbus_tcp_shm_open(const char* name);
+void modbus_tcp_shm_close(modbus_tcp_shm* shm);
+const modbus_tcp_shm_header_t* modbus_tcp_shm_layout(modbus_tcp_shm* shm);
+/* consistent copy of a slot, returns the number of registers stored into image (at most max_len),
+ * -1 when the slot stays locked by a publisher that is gone or the publisher is restarting */
+int modbus_tcp_shm_read(modbus_tcp_shm* shm, int device, modbus_tcp_shm_device_t* info, unsigned short* image, int max_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,474 @@
+#ifndef _MODBUS_TCP_CLIENT_HPP_
+#define _MODBUS_TCP_CLIENT_HPP_
+
+/*
+ * C++17 layer over modbus_tcp_client.h
+ *
+ * A device is described once as a register map :
+ *
+ *   using meter = modbus_tcp::register_map<
+ *       modbus_tcp::field<3000, float>,
+ *       modbus_tcp::field<3002, float>,
+ *       modbus_tcp::field<3110, std::uint32_t, modbus_tcp::word_order::low_first>>;
+ *
+ * and the merged multiblock read plan, the image layout and the decoder are
+ * all produced at compile time :
+ *
+ *   modbus_tcp::client dev("10.0.0.2", 502);
+ *   meter::values v;
+ *   if (dev.read<meter>(v) == 1) { float va = std::get<0>(v); }
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "modbus_tcp_client.h"
+
+namespace modbus_tcp {
+
+#if defined(__cpp_lib_span)
+template <typename T>
+using span = std::span<T>;
+#else
+template <typename T>
+class span {
+public:
+	constexpr span() noexcept : data_(nullptr), size_(0) {}
+	constexpr span(T* data, std::size_t size) noexcept : data_(data), size_(size) {}
+	template <std::size_t N>
+	constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+	template <typename U, std::size_t N, typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+	constexpr span(std::array<U, N>& array) noexcept : data_(array.data()), size_(N) {}
+	template <typename U, std::size_t N, typename = std::enable_if_t<std::is_convertible_v<const U (*)[], T (*)[]>>>
+	constexpr span(const std::array<U, N>& array) noexcept : data_(array.data()), size_(N) {}
+
+	constexpr T* data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr T& operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+	T* data_;
+	std::size_t size_;
+};
+#endif
+
+enum class word_order {
+	high_first = MODBUS_TCP_WORD_ORDER_HIGH_FIRST,
+	low_first = MODBUS_TCP_WORD_ORDER_LOW_FIRST,
+};
+
+/* register_traits<T> : number of registers and decoding for each supported value type */
+template <typename T>
+struct register_traits;
+
+template <>
+struct register_traits<std::uint16_t> {
+	static constexpr unsigned short words = 1;
+	static constexpr int type = MODBUS_TCP_TYPE_UINT16;
+	template <word_order>
+	static std::uint16_t decode(const unsigned short* p) noexcept { return p[0]; }
+};
+
+template <>
+struct register_traits<std::int16_t> {
+	static constexpr unsigned short words = 1;
+	static constexpr int type = MODBUS_TCP_TYPE_INT16;
+	template <word_order>
+	static std::int16_t decode(const unsigned short* p) noexcept { return static_cast<std::int16_t>(p[0]); }
+};
+
+template <>
+struct register_traits<std::uint32_t> {
+	static constexpr unsigned short words = 2;
+	static constexpr int type = MODBUS_TCP_TYPE_UINT32;
+	template <word_order Order>
+	static std::uint32_t decode(const unsigned short* p) noexcept
+	{
+		if constexpr (Order == word_order::low_first) {
+			return (static_cast<std::uint32_t>(p[1]) << 16) | p[0];
+		} else {
+			return (static_cast<std::uint32_t>(p[0]) << 16) | p[1];
+		}
+	}
+};
+
+template <>
+struct register_traits<std::int32_t> {
+	static constexpr unsigned short words = 2;
+	static constexpr int type = MODBUS_TCP_TYPE_INT32;
+	template <word_order Order>
+	static std::int32_t decode(const unsigned short* p) noexcept
+	{
+		return static_cast<std::int32_t>(register_traits<std::uint32_t>::decode<Order>(p));
+	}
+};
+
+template <>
+struct register_traits<float> {
+	static constexpr unsigned short words = 2;
+	static constexpr int type = MODBUS_TCP_TYPE_FLOAT32;
+	template <word_order Order>
+	static float decode(const unsigned short* p) noexcept
+	{
+		std::uint32_t raw = register_traits<std::uint32_t>::decode<Order>(p);
+		float value;
+		std::memcpy(&value, &raw, sizeof(value));
+		return value;
+	}
+};
+
+template <unsigned short Address, typename T, word_order Order = word_order::high_first>
+struct field {
+	using value_type = T;
+	static constexpr unsigned short address = Address;
+	static constexpr unsigned short words = register_traits<T>::words;
+	static constexpr word_order order = Order;
+};
+
+struct block {
+	unsigned short address;
+	unsigned short length;
+};
+
+namespace detail {
+
+template <std::size_t N>
+constexpr std::array<block, N> sort_ranges(std::array<block, N> ranges)
+{
+	for (std::size_t i = 1; i < N; i++) {
+		block key = ranges[i];
+		std::size_t j = i;
+
+		while (j > 0 && ranges[j - 1].address > key.address) {
+			ranges[j] = ranges[j - 1];
+			j--;
+		}
+		ranges[j] = key;
+	}
+
+	return ranges;
+}
+
+/* calls visit(index, block) for every merged block of the sorted ranges, returns the block count */
+template <std::size_t N, typename Visit>
+constexpr std::size_t merge_ranges(const std::array<block, N>& ranges, unsigned short max_gap, Visit&& visit)
+{
+	std::size_t count = 0;
+	unsigned long start = ranges[0].address;
+	unsigned long end = start + ranges[0].length;
+
+	for (std::size_t i = 1; i < N; i++) {
+		unsigned long next_end = ranges[i].address + ranges[i].length;
+
+		if (ranges[i].address <= end + max_gap) {
+			if (next_end > end) {
+				end = next_end;
+			}
+			continue;
+		}
+
+		visit(count++, block{ static_cast<unsigned short>(start), static_cast<unsigned short>(end - start) });
+		start = ranges[i].address;
+		end = next_end;
+	}
+
+	visit(count++, block{ static_cast<unsigned short>(start), static_cast<unsigned short>(end - start) });
+
+	return count;
+}
+
+/* one length per address and room in out for all of them */
+inline bool multiblock_fits(span<const unsigned short> addr, span<const unsigned short> len, span<unsigned short> out) noexcept
+{
+	std::size_t total = 0;
+
+	if (addr.size() != len.size()) return false;
+	for (std::size_t i = 0; i < len.size(); i++) {
+		total += len[i];
+	}
+
+	return total <= out.size();
+}
+
+}
+
+/*
+ * Fields closer than MaxGap registers apart share one block so the device
+ * answers a few long blocks instead of many short ones.
+ */
+template <unsigned short MaxGap, typename... Fields>
+class basic_register_map {
+	static_assert(sizeof...(Fields) > 0, "register map without fields");
+
+	static constexpr std::size_t num_of_field = sizeof...(Fields);
+
+	static constexpr std::array<block, num_of_field> ranges =
+		detail::sort_ranges(std::array<block, num_of_field>{ { { Fields::address, Fields::words }... } });
+
+public:
+	static constexpr std::size_t num_of_block = detail::merge_ranges(ranges, MaxGap, [](std::size_t, block) {});
+	static_assert(num_of_block <= 255, "register map needs more blocks than one multiblock read carries");
+
+	static constexpr std::array<block, num_of_block> plan = [] {
+		std::array<block, num_of_block> blocks{};
+		detail::merge_ranges(ranges, MaxGap, [&blocks](std::size_t i, block b) { blocks[i] = b; });
+		return blocks;
+	}();
+
+	static constexpr std::array<unsigned short, num_of_block> addresses = [] {
+		std::array<unsigned short, num_of_block> a{};
+		for (std::size_t i = 0; i < num_of_block; i++) a[i] = plan[i].address;
+		return a;
+	}();
+
+	static constexpr std::array<unsigned short, num_of_block> lengths = [] {
+		std::array<unsigned short, num_of_block> l{};
+		for (std::size_t i = 0; i < num_of_block; i++) l[i] = plan[i].length;
+		return l;
+	}();
+
+	static constexpr std::size_t image_length = [] {
+		std::size_t total = 0;
+		for (std::size_t i = 0; i < num_of_block; i++) total += plan[i].length;
+		return total;
+	}();
+
+	/* image offset of each field, in declaration order */
+	static constexpr std::array<std::size_t, num_of_field> offsets = [] {
+		std::array<std::size_t, num_of_field> result{};
+		std::array<unsigned short, num_of_field> address{ { Fields::address... } };
+
+		for (std::size_t f = 0; f < num_of_field; f++) {
+			std::size_t base = 0;
+
+			for (std::size_t b = 0; b < num_of_block; b++) {
+				if (address[f] >= plan[b].address && address[f] < plan[b].address + plan[b].length) {
+					result[f] = base + (address[f] - plan[b].address);
+					break;
+				}
+				base += plan[b].length;
+			}
+		}
+
+		return result;
+	}();
+
+	using values = std::tuple<typename Fields::value_type...>;
+	using image = std::array<unsigned short, image_length>;
+
+	static values decode(const image& data) noexcept
+	{
+		return decode(data.data(), std::index_sequence_for<Fields...>{});
+	}
+
+	/* -1 when data is shorter than the map's image, e.g. the image of another plan */
+	static int decode(span<const unsigned short> data, values& out) noexcept
+	{
+		if (data.size() < image_length) {
+			return -1;
+		}
+
+		out = decode(data.data(), std::index_sequence_for<Fields...>{});
+		return 1;
+	}
+
+private:
+	template <std::size_t... I>
+	static values decode(const unsigned short* data, std::index_sequence<I...>) noexcept
+	{
+		return values{ register_traits<typename Fields::value_type>::template decode<Fields::order>(data + offsets[I])... };
+	}
+};
+
+template <typename... Fields>
+using register_map = basic_register_map<8, Fields...>;
+
+/* owns a modbus_tcp_client, move only */
+class client {
+public:
+	client() noexcept = default;
+	client(const char* ipAddress, unsigned short port) noexcept
+		: handle_(modbus_tcp_client_open(const_cast<char*>(ipAddress), port)) {}
+	explicit client(modbus_tcp_client* handle) noexcept : handle_(handle) {}
+
+	client(const client&) = delete;
+	client& operator=(const client&) = delete;
+
+	client(client&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	client& operator=(client&& other) noexcept
+	{
+		if (this != &other) {
+			close();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~client() { close(); }
+
+	explicit operator bool() const noexcept { return handle_ != nullptr; }
+	modbus_tcp_client* get() const noexcept { return handle_; }
+	modbus_tcp_client* release() noexcept { return std::exchange(handle_, nullptr); }
+
+	void close() noexcept
+	{
+		if (handle_) {
+			modbus_tcp_client_close(handle_);
+			handle_ = nullptr;
+		}
+	}
+
+	void set_response_timeout(unsigned short timeout_msec) noexcept
+	{
+		modbus_tcp_client_set_response_timeout(handle_, timeout_msec);
+	}
+
+	unsigned int set_capture(modbus_tcp_capture* capture) noexcept
+	{
+		return modbus_tcp_client_set_capture(handle_, capture);
+	}
+
+	int read_holding(unsigned short address, span<unsigned short> out) noexcept
+	{
+		return modbus_tcp_read_holding_registers(handle_, address, static_cast<unsigned short>(out.size()), out.data());
+	}
+
+	int write_multiple(unsigned short address, span<const unsigned short> data) noexcept
+	{
+		return modbus_tcp_write_multiple_registers(handle_, address, static_cast<unsigned short>(data.size()),
+			const_cast<unsigned short*>(data.data()));
+	}
+
+	int set_frame_limits(int max_request, int max_response) noexcept
+	{
+		return modbus_tcp_client_set_frame_limits(handle_, max_request, max_response);
+	}
+
+	void set_keepalive(unsigned short idle_msec, unsigned short address) noexcept
+	{
+		modbus_tcp_client_set_keepalive(handle_, idle_msec, address);
+	}
+
+	modbus_tcp_link_stats_t link_stats() const noexcept
+	{
+		modbus_tcp_link_stats_t stats{};
+		modbus_tcp_client_get_link_stats(handle_, &stats);
+		return stats;
+	}
+
+	int read_multiblock(span<const unsigned short> addr, span<const unsigned short> len, span<unsigned short> out) noexcept
+	{
+		if (!detail::multiblock_fits(addr, len, out)) return -1;
+		return modbus_tcp_read_multiblock_registers(handle_, static_cast<int>(addr.size()),
+			const_cast<unsigned short*>(addr.data()), const_cast<unsigned short*>(len.data()), out.data());
+	}
+
+	/* the result is 0 when the device refused some write blocks, acks (empty or one per block) receives every ack */
+	int read_write_multiblock(span<modbus_tcp_multiblock_request_t> requests, span<unsigned short> acks = {}) noexcept
+	{
+		if (acks.size() != 0 && acks.size() < requests.size()) return -1;
+		return modbus_tcp_read_write_multiblock_registers_ack(handle_, requests.data(), static_cast<int>(requests.size()),
+			acks.size() == 0 ? nullptr : acks.data());
+	}
+
+	template <typename Map>
+	int read(typename Map::image& image) noexcept
+	{
+		return modbus_tcp_read_multiblock_registers(handle_, static_cast<int>(Map::num_of_block),
+			const_cast<unsigned short*>(Map::addresses.data()), const_cast<unsigned short*>(Map::lengths.data()), image.data());
+	}
+
+	template <typename Map>
+	int read(typename Map::values& values) noexcept
+	{
+		typename Map::image image;
+		int res = read<Map>(image);
+
+		if (res == 1) {
+			values = Map::decode(image);
+		}
+
+		return res;
+	}
+
+private:
+	modbus_tcp_client* handle_ = nullptr;
+};
+
+/* owns a modbus_tcp_poll_plan, built from a register map or a block list */
+class poll_plan {
+public:
+	poll_plan() noexcept = default;
+
+	poll_plan(span<const unsigned short> addr, span<const unsigned short> len) noexcept
+		: handle_(modbus_tcp_poll_plan_create(static_cast<int>(addr.size()),
+			const_cast<unsigned short*>(addr.data()), const_cast<unsigned short*>(len.data()))) {}
+
+	template <typename Map>
+	static poll_plan from_map() noexcept
+	{
+		return poll_plan(Map::addresses, Map::lengths);
+	}
+
+	poll_plan(const poll_plan&) = delete;
+	poll_plan& operator=(const poll_plan&) = delete;
+
+	poll_plan(poll_plan&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	poll_plan& operator=(poll_plan&& other) noexcept
+	{
+		if (this != &other) {
+			modbus_tcp_poll_plan_destroy(handle_);
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~poll_plan() { modbus_tcp_poll_plan_destroy(handle_); }
+
+	explicit operator bool() const noexcept { return handle_ != nullptr; }
+	modbus_tcp_poll_plan* get() const noexcept { return handle_; }
+
+	int poll(client& c) noexcept { return modbus_tcp_poll(c.get(), handle_); }
+
+	span<const unsigned short> image() const noexcept
+	{
+		int len = 0;
+		const unsigned short* data = modbus_tcp_poll_plan_image(handle_, &len);
+		return span<const unsigned short>(data, static_cast<std::size_t>(len));
+	}
+
+	/* -1 when the plan's image is shorter than the map's */
+	template <typename Map>
+	int decode(typename Map::values& out) const noexcept
+	{
+		return Map::decode(image(), out);
+	}
+
+	/* calls visit(const modbus_tcp_change_t&) for every changed run of the last scan */
+	template <typename Visit>
+	void for_each_change(Visit&& visit) const
+	{
+		modbus_tcp_change_t change;
+		int cursor = 0;
+
+		while (modbus_tcp_poll_plan_next_change(handle_, &cursor, &change)) {
+			visit(change);
+		}
+	}
+
+private:
+	modbus_tcp_poll_plan* handle_ = nullptr;
+};
+
+}
+
+#endif
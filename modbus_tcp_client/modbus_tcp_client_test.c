@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "modbus_tcp_client.h"
 
@@ -27,6 +29,9 @@ int proc_rd(struct command* cmd, char** parameter, const char* option);
 int proc_wr(struct command* cmd, char** parameter, const char* option);
 int proc_quit(struct command* cmd, char** parameter, const char* option);
 int proc_multi_rd(struct command* cmd, char** parameter, const char* option);
+int proc_bench(struct command* cmd, char** parameter, const char* option);
+int proc_watch(struct command* cmd, char** parameter, const char* option);
+int proc_sleep(struct command* cmd, char** parameter, const char* option);
 int proc_help(struct command* cmd, char** parameter, const char* option);
 
 struct command {
@@ -39,14 +44,24 @@ struct command {
 	{"open",	1, "502",	proc_open,		"open <ipString> (port)"},
 	{"wr",   	1, "",		proc_wr,		"wr <addr> (value)"},
 	{"rd",   	1, "125",	proc_rd,		"rd <addr> (length = 125)"},
-    {"multi", 0, "1200",	proc_multi_rd,	"multi <addr> (length = 1200)"},
+	{"multi",	1, "1200",	proc_multi_rd,	"multi <addr> (length = 1200) (<addr>:<length> ...)"},
+	{"bench",	1, "10",	proc_bench,		"bench <addr> (length = 10) (fc=3|65) (n=<requests> | time=<sec>) (rate=<req/s>) (c=<connections per device>) (dev=<ip>[:port],...)"},
+	{"watch",	1, "10",	proc_watch,		"watch <addr> (length = 10) (<addr>:<length> ...) (interval=<msec>) (count=<scans>)"},
+	{"sleep",	1, "",		proc_sleep,		"sleep <msec>"},
 	{"quit", 	0, "",		proc_quit,		"quit"},
 	{"help", 	0, "",		proc_help,		"help"},
 };
 
 #define NUM_OF_COMMAND (sizeof(command) / sizeof(struct command))
+#define MAX_PARAM 16
+#define MAX_READ_LENGTH 125
 
 static modbus_tcp_client* client = NULL;
+static char client_ip[64];
+static unsigned int client_port;
+
+/* commands come from a script file or stdin, words after the option follow the parameters in parameter[] */
+static FILE* input;
 
 int proc_open(struct command* cmd, char** parameter, const char* option)
 {
@@ -60,6 +75,8 @@ int proc_open(struct command* cmd, char** parameter, const char* option)
 	client = modbus_tcp_client_open(parameter[0], port);
 	
 	if (client) {
+		snprintf(client_ip, sizeof(client_ip), "%s", parameter[0]);
+		client_port = port;
 		printf("%s:%d open\n", parameter[0], port);
 	} else {
 		printf("open fail\n");
@@ -68,32 +85,10 @@ int proc_open(struct command* cmd, char** parameter, const char* option)
 	return 0;
 }
 
-int proc_rd(struct command* cmd, char** parameter, const char* option)
+static void dump_registers(unsigned short addr, const unsigned short* data, int len)
 {
-	unsigned short addr;
-	unsigned short len;
-	unsigned short data[128];
-	struct stat st;
-	int res;
 	int i;
-	
-	if (!client) {
-		printf("client not opened\n");
-		return 0;
-	}
-	
-	sscanf(parameter[0], "%hu", &addr);
-	sscanf(option, "%hu", &len);
-		
-	res = modbus_tcp_read_holding_registers(client, addr - 1, len, data);
-	if (res < 1) {
-		printf("error modbus_tcp_read_registers(%x, %d)\n", addr, len);
-
-		return res;
-	} 
 
-	printf("modbus_tcp_read_registers response message : %d\n", res);	
-	
 	for (i=0; i<len;) {
 		int j;
 		
@@ -105,6 +100,48 @@ int proc_rd(struct command* cmd, char** parameter, const char* option)
 		
 		printf("\n");
 	}
+}
+
+int proc_rd(struct command* cmd, char** parameter, const char* option)
+{
+	unsigned short addr;
+	unsigned int len = 0;
+	unsigned short* data;
+	unsigned int offset;
+	int res = 1;
+	
+	if (!client) {
+		printf("client not opened\n");
+		return 0;
+	}
+	
+	sscanf(parameter[0], "%hu", &addr);
+	sscanf(option, "%u", &len);
+	if (len == 0 || addr + len - 1 > 0xFFFF) {
+		printf("invalid length %u\n", len);
+		return 0;
+	}
+
+	data = malloc(len * sizeof(unsigned short));
+	if (!data) return 0;
+
+	/* longer reads go out as consecutive requests of at most 125 registers */
+	for (offset=0; offset<len; offset+=MAX_READ_LENGTH) {
+		unsigned short chunk = len - offset < MAX_READ_LENGTH ? len - offset : MAX_READ_LENGTH;
+
+		res = modbus_tcp_read_holding_registers(client, addr - 1 + offset, chunk, data + offset);
+		if (res < 1) {
+			printf("error modbus_tcp_read_registers(%x, %d)\n", addr + offset, chunk);
+			free(data);
+			return res;
+		}
+	}
+
+	printf("modbus_tcp_read_registers response message : %d\n", res);	
+	
+	dump_registers(addr, data, len);
+
+	free(data);
 	
 	return 0;
 }
@@ -131,7 +168,7 @@ int proc_wr(struct command* cmd, char** parameter, const char* option)
 			char line[100];
 			char* res;
 			
-			res = fgets(line, sizeof(line), stdin);
+			res = fgets(line, sizeof(line), input);
 			if (res == NULL || line[0] == 0 || line[0] == '\n') {
 				end_of_request = 1;
 			} else {
@@ -167,60 +204,443 @@ int proc_wr(struct command* cmd, char** parameter, const char* option)
 }
 
 
+/* "<addr>:<length>" words after the option, addresses are 1-based like on the command line */
+static int parse_blocks(char** extra, unsigned short* addr, unsigned short* len, int max_block)
+{
+	int num_of_block = 0;
+	int i;
+
+	for (i=0; extra[i]; i++) {
+		unsigned short a, l;
+
+		if (strchr(extra[i], '=')) continue;
+
+		if (sscanf(extra[i], "%hu:%hu", &a, &l) != 2 || a == 0 || l == 0) {
+			printf("invalid block %s\n", extra[i]);
+			return -1;
+		}
+		if (num_of_block == max_block) {
+			printf("too many blocks\n");
+			return -1;
+		}
+
+		addr[num_of_block] = a - 1;
+		len[num_of_block] = l;
+		num_of_block++;
+	}
+
+	return num_of_block;
+}
+
+/* value of "key=value" among the words after the option, NULL when absent */
+static const char* find_key(char** extra, const char* key)
+{
+	size_t key_len = strlen(key);
+	int i;
+
+	for (i=0; extra[i]; i++) {
+		if (strncmp(extra[i], key, key_len) == 0 && extra[i][key_len] == '=') {
+			return extra[i] + key_len + 1;
+		}
+	}
+
+	return NULL;
+}
+
 int proc_multi_rd(struct command* cmd, char** parameter, const char* option)
 {
-	unsigned short addr = 1999 , i;
-	unsigned short value;
-	unsigned short data[2000] = {0, };
-	unsigned short len = 1200;
+	unsigned short addr[MAX_PARAM], len[MAX_PARAM];
+	unsigned short* data;
+	int num_of_block, data_len = 0;
 	int res = 0;
+	int i, offset;
 
 	if (!client) {
 		printf("client not opened\n");
 		return 0;
 	}
 
-	// sscanf(parameter[0], "%hu", &addr);
-	// sscanf(option, "%hu", &len);
+	if (sscanf(parameter[0], "%hu", &addr[0]) != 1 || addr[0] == 0 || sscanf(option, "%hu", &len[0]) != 1 || len[0] == 0) {
+		printf("usage : %s\n", cmd->usage);
+		return 0;
+	}
+	addr[0]--;
+
+	num_of_block = parse_blocks(parameter + cmd->param_cnt, addr + 1, len + 1, MAX_PARAM - 1);
+	if (num_of_block < 0) return 0;
+	num_of_block++;
+
+	for (i=0; i<num_of_block; i++) {
+		data_len += len[i];
+	}
+
+	data = malloc(data_len * sizeof(unsigned short));
+	if (!data) return 0;
 	
-	res = modbus_tcp_read_multiblock_registers(client, 1, &addr, &len, data);
+	res = modbus_tcp_read_multiblock_registers(client, num_of_block, addr, len, data);
 	if (res < 1) {
-		printf("error modbus_tcp_read_registers(%x, %d)\n", addr, len);
-
+		printf("error modbus_tcp_read_registers(%x, %d)\n", addr[0] + 1, len[0]);
+		free(data);
 		return res;
 	}
 
 	printf("modbus_tcp_read_registers response message : %d\n", res);
-	
-	printf("address 0 : ");
-	for (i=0; i<len ; i++) {
-		printf(" %04x", data[i]);
-		// if(len % )
+
+	for (i=0, offset=0; i<num_of_block; offset+=len[i], i++) {
+		dump_registers(addr[i] + 1, data + offset, len[i]);
 	}
-	printf("\n");
 
-	// printf("address 1119 : ");
-	// for (i = 1000; i<1916 ; i++) {
-	// 	printf(" %04x", data[i]);
-	// }
-	// printf("\n");
-	// for (i=0; i<len;) {
-	// 	int j;
+	free(data);
+
+	return res;
+}
+
+static unsigned long long now_usec(void)
+{
+	struct timespec ts;
 
-	// 	printf("%04x :", addr + i);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	// 	for (j=0; j<16 && i<len; j++, i++) {
-	// 		printf(" %04x", data[i]);
-	// 	}
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	// 	printf("\n");
+struct bench_slot {
+	modbus_tcp_transaction_t t;
+	unsigned short addr;
+	unsigned short len;
+	unsigned short* buffer;
+	struct bench_slot* next_free;
+};
 
-	// 	for (j=1000; j<1016 && i<len; j++, i++) {
-	// 		printf(" %04x", data[i]);
-	// 	}
-	// }
+struct bench {
+	struct bench_slot* free_head;
+	struct bench_slot* free_tail;
+	unsigned int* latency;
+	int num_of_latency;
+	int max_latency;
+	int result[5];
+};
 
-	return res;
+static void bench_release(struct bench* b, struct bench_slot* slot)
+{
+	slot->next_free = NULL;
+	if (b->free_tail) {
+		b->free_tail->next_free = slot;
+	} else {
+		b->free_head = slot;
+	}
+	b->free_tail = slot;
+}
+
+static void bench_complete(modbus_tcp_transaction_t* t)
+{
+	struct bench_slot* slot = (struct bench_slot*)t;
+	struct bench* b = t->user_data;
+
+	if (t->result >= MODBUS_TCP_CANCELLED && t->result <= MODBUS_TCP_OK) {
+		b->result[t->result - MODBUS_TCP_CANCELLED]++;
+	}
+
+	if (t->result == MODBUS_TCP_OK) {
+		if (b->num_of_latency == b->max_latency) {
+			int max_latency = b->max_latency ? b->max_latency * 2 : 4096;
+			unsigned int* latency = realloc(b->latency, max_latency * sizeof(unsigned int));
+
+			if (latency) {
+				b->latency = latency;
+				b->max_latency = max_latency;
+			}
+		}
+		if (b->num_of_latency < b->max_latency) {
+			b->latency[b->num_of_latency++] = t->completed_usec - t->submitted_usec;
+		}
+	}
+
+	bench_release(b, slot);
+}
+
+static int compare_uint(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned int percentile(struct bench* b, double p)
+{
+	int i = (int)(p / 100.0 * b->num_of_latency);
+
+	if (i >= b->num_of_latency) i = b->num_of_latency - 1;
+
+	return b->latency[i];
+}
+
+/*
+ * Every device gets c connections with one request in flight each. Without a
+ * rate the connections are kept busy, with a rate requests are issued on a
+ * fixed schedule whenever a connection is free, so the device sees the
+ * offered load rather than a closed loop.
+ */
+int proc_bench(struct command* cmd, char** parameter, const char* option)
+{
+	char** extra = parameter + cmd->param_cnt;
+	const char* value;
+	char devices[512];
+	char* device;
+	char* save;
+	struct bench b;
+	struct bench_slot* slots = NULL;
+	modbus_tcp_client** clients = NULL;
+	modbus_tcp_poller* poller;
+	unsigned short addr, len = 0;
+	int fc = 3, connections = 1, num_of_client = 0, num_of_slot = 0;
+	long requests = 1000, issued = 0;
+	double duration = 0, rate = 0, elapsed;
+	unsigned long long start, now, end = 0;
+	int i;
+
+	if (sscanf(parameter[0], "%hu", &addr) != 1 || addr == 0 || sscanf(option, "%hu", &len) != 1 || len == 0) {
+		printf("usage : %s\n", cmd->usage);
+		return 0;
+	}
+
+	if ((value = find_key(extra, "fc"))) fc = strtol(value, NULL, 16);
+	if ((value = find_key(extra, "n"))) requests = atol(value);
+	if ((value = find_key(extra, "time"))) duration = atof(value);
+	if ((value = find_key(extra, "rate"))) rate = atof(value);
+	if ((value = find_key(extra, "c"))) connections = atoi(value);
+
+	if ((fc != 3 && fc != 0x65) || (fc == 3 && len > MAX_READ_LENGTH) || connections < 1 || (requests < 1 && duration <= 0)) {
+		printf("usage : %s\n", cmd->usage);
+		return 0;
+	}
+
+	if ((value = find_key(extra, "dev"))) {
+		snprintf(devices, sizeof(devices), "%s", value);
+	} else if (client) {
+		snprintf(devices, sizeof(devices), "%s:%u", client_ip, client_port);
+	} else {
+		printf("client not opened, give dev=<ip>[:port]\n");
+		return 0;
+	}
+
+	memset(&b, 0, sizeof(b));
+	poller = modbus_tcp_poller_create();
+	if (!poller) return 0;
+
+	for (device = strtok_r(devices, ",", &save); device; device = strtok_r(NULL, ",", &save)) {
+		char* colon = strchr(device, ':');
+		unsigned short port = 502;
+
+		if (colon) {
+			*colon = 0;
+			port = atoi(colon + 1);
+		}
+
+		for (i=0; i<connections; i++) {
+			modbus_tcp_client* c = modbus_tcp_client_open(device, port);
+			modbus_tcp_client** more;
+
+			if (!c) {
+				printf("%s:%u open fail\n", device, port);
+				goto do_close;
+			}
+
+			more = realloc(clients, (num_of_client + 1) * sizeof(modbus_tcp_client*));
+			if (!more) {
+				printf("out of memory\n");
+				modbus_tcp_client_close(c);
+				goto do_close;
+			}
+			clients = more;
+			clients[num_of_client++] = c;
+
+			if (modbus_tcp_poller_add(poller, c) < 0) {
+				printf("%s:%u poller add fail\n", device, port);
+				goto do_close;
+			}
+		}
+	}
+
+	slots = calloc(num_of_client, sizeof(struct bench_slot));
+	if (!slots) {
+		printf("out of memory\n");
+		goto do_close;
+	}
+	num_of_slot = num_of_client;
+	for (i=0; i<num_of_slot; i++) {
+		slots[i].addr = addr - 1;
+		slots[i].len = len;
+		slots[i].buffer = malloc(len * sizeof(unsigned short));
+		if (!slots[i].buffer) {
+			printf("out of memory\n");
+			goto do_close;
+		}
+		bench_release(&b, &slots[i]);
+	}
+
+	printf("bench fc %x, %d registers, %d connections, %s\n", fc, len, num_of_client, duration > 0 ? "timed" : "counted");
+
+	start = now_usec();
+	if (duration > 0) {
+		end = start + (unsigned long long)(duration * 1000000);
+	}
+
+	for (;;) {
+		int timeout_msec = -1;
+		long due;
+
+		now = now_usec();
+		if (duration > 0 ? now >= end : issued >= requests) {
+			if (modbus_tcp_poller_pending(poller) == 0) break;
+			modbus_tcp_poller_run(poller, -1);
+			continue;
+		}
+
+		due = rate > 0 ? (long)((now - start) * rate / 1000000) + 1 : issued + num_of_slot;
+		if (duration <= 0 && due > requests) due = requests;
+
+		while (issued < due && b.free_head) {
+			struct bench_slot* slot = b.free_head;
+			modbus_tcp_client* c = clients[(slot - slots) % num_of_client];
+
+			b.free_head = slot->next_free;
+			if (!b.free_head) b.free_tail = NULL;
+
+			if (fc == 3) {
+				modbus_tcp_prepare_read_holding_registers(&slot->t, c, slot->addr, slot->len, slot->buffer);
+			} else {
+				modbus_tcp_prepare_read_multiblock_registers(&slot->t, c, 1, &slot->addr, &slot->len, slot->buffer);
+			}
+			slot->t.complete = bench_complete;
+			slot->t.user_data = &b;
+			modbus_tcp_poller_submit(poller, &slot->t);
+			issued++;
+		}
+
+		if (rate > 0 && issued >= due) {
+			timeout_msec = (int)(((double)issued * 1000000 / rate + start - now) / 1000);
+			if (timeout_msec < 0) timeout_msec = 0;
+		}
+		if (duration > 0) {
+			int left_msec = (end - now + 999) / 1000;
+
+			if (timeout_msec < 0 || left_msec < timeout_msec) timeout_msec = left_msec;
+		}
+
+		modbus_tcp_poller_run(poller, timeout_msec);
+	}
+
+	elapsed = (now_usec() - start) / 1e6;
+
+	printf("%ld requests in %.3f s : %.1f req/s\n", issued, elapsed, issued / elapsed);
+	printf("ok %d, exception %d, error %d, timeout %d\n",
+		b.result[MODBUS_TCP_OK - MODBUS_TCP_CANCELLED], b.result[MODBUS_TCP_EXCEPTION - MODBUS_TCP_CANCELLED],
+		b.result[MODBUS_TCP_ERROR - MODBUS_TCP_CANCELLED], b.result[MODBUS_TCP_TIMEOUT - MODBUS_TCP_CANCELLED]);
+	if (rate > 0 && issued / elapsed < rate * 0.95) {
+		printf("target rate %.1f req/s not reached, add connections\n", rate);
+	}
+
+	if (b.num_of_latency > 0) {
+		qsort(b.latency, b.num_of_latency, sizeof(unsigned int), compare_uint);
+		printf("latency usec : min %u, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+			b.latency[0], percentile(&b, 50), percentile(&b, 90), percentile(&b, 99), percentile(&b, 99.9),
+			b.latency[b.num_of_latency - 1]);
+	}
+
+do_close:
+	for (i=0; i<num_of_client; i++) {
+		modbus_tcp_client_close(clients[i]);
+	}
+	for (i=0; i<num_of_slot; i++) {
+		free(slots[i].buffer);
+	}
+	free(slots);
+	free(clients);
+	free(b.latency);
+	modbus_tcp_poller_destroy(poller);
+
+	return 0;
+}
+
+int proc_watch(struct command* cmd, char** parameter, const char* option)
+{
+	char** extra = parameter + cmd->param_cnt;
+	const char* value;
+	unsigned short addr[MAX_PARAM], len[MAX_PARAM];
+	modbus_tcp_poll_plan* plan;
+	int num_of_block, interval_msec = 1000, count = 0, last_status = 1;
+	int scan;
+
+	if (!client) {
+		printf("client not opened\n");
+		return 0;
+	}
+
+	if (sscanf(parameter[0], "%hu", &addr[0]) != 1 || addr[0] == 0 || sscanf(option, "%hu", &len[0]) != 1 || len[0] == 0) {
+		printf("usage : %s\n", cmd->usage);
+		return 0;
+	}
+	addr[0]--;
+
+	num_of_block = parse_blocks(extra, addr + 1, len + 1, MAX_PARAM - 1);
+	if (num_of_block < 0) return 0;
+	num_of_block++;
+
+	if ((value = find_key(extra, "interval"))) interval_msec = atoi(value);
+	if ((value = find_key(extra, "count"))) count = atoi(value);
+
+	plan = modbus_tcp_poll_plan_create(num_of_block, addr, len);
+	if (!plan) return 0;
+
+	for (scan=0; count == 0 || scan < count; scan++) {
+		unsigned long long next = now_usec() + (unsigned long long)interval_msec * 1000;
+		struct timespec ts;
+		struct tm tm;
+		int res;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		localtime_r(&ts.tv_sec, &tm);
+
+		res = modbus_tcp_poll(client, plan);
+		if (res < 1) {
+			if (res != last_status) {
+				printf("%02d:%02d:%02d.%03ld scan failed : %d\n", tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000, res);
+			}
+		} else {
+			modbus_tcp_change_t change;
+			int cursor = 0;
+			int i;
+
+			while (modbus_tcp_poll_plan_next_change(plan, &cursor, &change)) {
+				for (i=0; i<change.length; i++) {
+					printf("%02d:%02d:%02d.%03ld %5u : %04x (%u)\n", tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000,
+						change.address + i + 1, change.value[i], change.value[i]);
+				}
+			}
+		}
+		last_status = res;
+		fflush(stdout);
+
+		if (count == 0 || scan + 1 < count) {
+			unsigned long long now = now_usec();
+
+			if (next > now) {
+				usleep(next - now);
+			}
+		}
+	}
+
+	modbus_tcp_poll_plan_destroy(plan);
+
+	return 0;
+}
+
+int proc_sleep(struct command* cmd, char** parameter, const char* option)
+{
+	usleep(atoi(parameter[0]) * 1000);
+
+	return 0;
 }
 
 int proc_quit(struct command* cmd, char** parameter, const char* option)
@@ -265,32 +685,53 @@ int get_word(const char* string, int str_size, char* word, int word_size, int *i
 //get word는 결국 읽기용 str을 word라는 그냥 rw str으로 반환해 주는 역할
 int main(int argc, char* argv[])
 {
+	int interactive;
+
+	/* modbus_tcp_client_test (script) : commands are read from the script instead of the terminal */
+	input = stdin;
+	if (argc > 1) {
+		input = fopen(argv[1], "r");
+		if (!input) {
+			printf("can not open %s\n", argv[1]);
+			return 1;
+		}
+	}
+	interactive = isatty(fileno(input));
+
 	while (1) {
-		char line[100];
+		char line[512];
 		char word[100];
 		int idx;
 		int i;
 		
 		//그냥 쉘에서 확인하는 부분들.
 	next_cmd:
-		printf("modbusTcp> ");
+		if (interactive) {
+			printf("modbusTcp> ");
+		}
 		
-		if (fgets(line, sizeof(line), stdin) == NULL) {
+		if (fgets(line, sizeof(line), input) == NULL) {
 			break;
 		}//표준입력, 즉 쉘에서 문자 입력 시 break
 		//이때의 null 값은 읽기 실패를 말한다.
 		idx = 0;
 		
-		if (get_word(line, sizeof(line), word, sizeof(word), &idx) == 0) {
+		if (get_word(line, sizeof(line), word, sizeof(word), &idx) == 0 || word[0] == '#') {
 			continue;
 		}//line을 버퍼로 쓰고 word에 해당 ㄱ
+
+		if (!interactive) {
+			printf("modbusTcp> %s", line);
+			if (!strchr(line, '\n')) printf("\n");
+		}
 		
 		for (i=0; i<NUM_OF_COMMAND; i++) {
 			if (strcmp(word, command[i].cmd) == 0) {
 				int param_idx;
-				char *param_list[10];
-				char param[10][100];
+				char *param_list[MAX_PARAM + 1];
+				char param[MAX_PARAM][100];
 				char option[100];
+				const char* option_used = command[i].option;
 				
 				for (param_idx=0; param_idx < command[i].param_cnt; param_idx++) {
 					if (get_word(line, sizeof(line), param[param_idx], sizeof(param[param_idx]), &idx) == 0) {
@@ -301,11 +742,25 @@ int main(int argc, char* argv[])
 					param_list[param_idx] = param[param_idx];
 				}
 				
-				if (get_word(line, sizeof(line), option, sizeof(option), &idx) == 0) {
-					(command[i].proc_func)(&command[i], param_list, command[i].option);
-				} else {
-					(command[i].proc_func)(&command[i], param_list, option);
+				if (get_word(line, sizeof(line), option, sizeof(option), &idx) != 0) {
+					/* a key=value right after the parameters leaves the option at its default */
+					if (strchr(option, '=')) {
+						strcpy(param[param_idx], option);
+						param_list[param_idx] = param[param_idx];
+						param_idx++;
+					} else {
+						option_used = option;
+					}
+				}
+
+				/* remaining words follow the parameters */
+				while (param_idx < MAX_PARAM && get_word(line, sizeof(line), param[param_idx], sizeof(param[param_idx]), &idx) != 0) {
+					param_list[param_idx] = param[param_idx];
+					param_idx++;
 				}
+				param_list[param_idx] = NULL;
+
+				(command[i].proc_func)(&command[i], param_list, option_used);
 				
 				break;
 			}
@@ -0,0 +1,391 @@
+#ifndef _MODBUS_TCP_CORO_HPP_
+#define _MODBUS_TCP_CORO_HPP_
+
+/*
+ * C++20 coroutine layer over the poller
+ *
+ *   modbus_tcp::event_loop loop;
+ *   modbus_tcp::async_client meter(loop, "10.0.0.2", 502);
+ *
+ *   modbus_tcp::task<> scan(modbus_tcp::async_client& meter, std::stop_token stop)
+ *   {
+ *       auto r = co_await meter.read_holding(3000, 10, stop);
+ *       if (r.status == MODBUS_TCP_OK) { ... r.values ... }
+ *   }
+ *
+ *   loop.spawn(scan(meter, source.get_token()));
+ *   loop.run();
+ *
+ * Every awaiting coroutine parks one transaction on the poller instead of a
+ * thread. A transaction ends with MODBUS_TCP_TIMEOUT after its timeout (the
+ * client's response timeout unless given) and with MODBUS_TCP_CANCELLED
+ * once its stop token is triggered. A loop and everything on it belong to
+ * one thread, only the stop tokens may be triggered from any thread : the
+ * cancellation is handed to the loop's next run.
+ */
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+#include "modbus_tcp_client.hpp"
+
+namespace modbus_tcp {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+template <typename Promise>
+struct final_awaiter {
+	bool await_ready() noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+	{
+		std::coroutine_handle<> continuation = h.promise().continuation;
+		return continuation ? continuation : std::noop_coroutine();
+	}
+	void await_resume() noexcept {}
+};
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+	final_awaiter<task_promise> final_suspend() noexcept { return {}; }
+	template <typename U>
+	void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+	T result()
+	{
+		if (exception) std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct task_promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	final_awaiter<task_promise> final_suspend() noexcept { return {}; }
+	void return_void() noexcept {}
+
+	void result()
+	{
+		if (exception) std::rethrow_exception(exception);
+	}
+};
+
+}
+
+/* lazily started coroutine, runs when awaited or spawned on a loop */
+template <typename T>
+class task {
+public:
+	using promise_type = detail::task_promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type handle) noexcept : handle_(handle) {}
+	task(task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	task& operator=(task&& other) noexcept
+	{
+		if (this != &other) {
+			if (handle_) handle_.destroy();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+	~task() { if (handle_) handle_.destroy(); }
+
+	bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+	{
+		handle_.promise().continuation = continuation;
+		return handle_;
+	}
+	T await_resume() { return handle_.promise().result(); }
+
+private:
+	handle_type handle_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> task_promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/* fire and forget frame owning a spawned task, destroys itself at the end */
+struct detached {
+	struct promise_type {
+		detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+}
+
+class event_loop {
+public:
+	explicit event_loop(int backend = MODBUS_TCP_POLLER_EPOLL) noexcept : poller_(modbus_tcp_poller_create_backend(backend)) {}
+	~event_loop() { modbus_tcp_poller_destroy(poller_); }
+
+	event_loop(const event_loop&) = delete;
+	event_loop& operator=(const event_loop&) = delete;
+
+	explicit operator bool() const noexcept { return poller_ != nullptr; }
+	modbus_tcp_poller* get() const noexcept { return poller_; }
+
+	/* starts t right away, the loop keeps it alive until it returns */
+	template <typename T>
+	void spawn(task<T> t)
+	{
+		spawned_++;
+		run_detached(std::move(t));
+	}
+
+	int run_once(int timeout_msec = -1) noexcept
+	{
+		return modbus_tcp_poller_run(poller_, timeout_msec);
+	}
+
+	/* runs until all spawned tasks returned or nothing is left to wait for */
+	void run() noexcept
+	{
+		while (spawned_ > 0 && modbus_tcp_poller_pending(poller_) > 0) {
+			run_once(-1);
+		}
+	}
+
+	std::size_t spawned() const noexcept { return spawned_; }
+
+private:
+	template <typename T>
+	detail::detached run_detached(task<T> t)
+	{
+		co_await std::move(t);
+		spawned_--;
+	}
+
+	modbus_tcp_poller* poller_;
+	std::size_t spawned_ = 0;
+};
+
+/*
+ * Awaits one poller transaction, the result of co_await is the transaction
+ * result (MODBUS_TCP_OK, MODBUS_TCP_EXCEPTION, ...).
+ */
+class transaction_awaiter {
+public:
+	template <typename Prepare>
+	transaction_awaiter(modbus_tcp_poller* poller, std::stop_token stop, unsigned short timeout_msec, Prepare&& prepare)
+		: poller_(poller), stop_(std::move(stop))
+	{
+		prepare(transaction_);
+		transaction_.timeout_msec = timeout_msec;
+	}
+
+	transaction_awaiter(const transaction_awaiter&) = delete;
+	transaction_awaiter& operator=(const transaction_awaiter&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		if (stop_.stop_requested()) {
+			transaction_.result = MODBUS_TCP_CANCELLED;
+			return false;
+		}
+
+		handle_ = handle;
+		transaction_.user_data = this;
+		transaction_.complete = &transaction_awaiter::on_complete;
+
+		/* a transaction can complete inside submit, then do not suspend at all */
+		submitting_ = true;
+		if (modbus_tcp_poller_submit(poller_, &transaction_) < 0) {
+			submitting_ = false;
+			done_ = true;
+			transaction_.result = MODBUS_TCP_ERROR;
+			return false;
+		}
+		if (!done_ && stop_.stop_possible()) {
+			stop_callback_.emplace(stop_, canceller{ this });
+		}
+		submitting_ = false;
+
+		return !done_;
+	}
+
+	int await_resume() noexcept
+	{
+		stop_callback_.reset();
+		return transaction_.result;
+	}
+
+	const modbus_tcp_transaction_t& transaction() const noexcept { return transaction_; }
+
+protected:
+	/* for awaiters preparing the transaction themselves */
+	transaction_awaiter(modbus_tcp_poller* poller, std::stop_token stop) noexcept
+		: poller_(poller), stop_(std::move(stop))
+	{
+	}
+
+	modbus_tcp_transaction_t transaction_;
+
+private:
+	/* runs on the thread requesting the stop, the loop's thread does the cancel */
+	struct canceller {
+		transaction_awaiter* self;
+		void operator()() const noexcept { modbus_tcp_poller_cancel_async(self->poller_, &self->transaction_); }
+	};
+
+	static void on_complete(modbus_tcp_transaction_t* t)
+	{
+		transaction_awaiter* self = static_cast<transaction_awaiter*>(t->user_data);
+
+		self->done_ = true;
+		if (!self->submitting_) {
+			self->handle_.resume();
+		}
+	}
+
+	modbus_tcp_poller* poller_;
+	std::stop_token stop_;
+	std::optional<std::stop_callback<canceller>> stop_callback_;
+	std::coroutine_handle<> handle_;
+	bool submitting_ = false;
+	bool done_ = false;
+};
+
+struct read_result {
+	int status;
+	std::vector<unsigned short> values;
+
+	explicit operator bool() const noexcept { return status == MODBUS_TCP_OK; }
+};
+
+/* read into a buffer the awaiter owns, for callers that do not keep one */
+class read_awaiter : public transaction_awaiter {
+public:
+	read_awaiter(modbus_tcp_poller* poller, modbus_tcp_client* client, unsigned short address, unsigned short len,
+		std::stop_token stop, unsigned short timeout_msec)
+		: transaction_awaiter(poller, std::move(stop)), values_(len)
+	{
+		modbus_tcp_prepare_read_holding_registers(&transaction_, client, address, len, values_.data());
+		transaction_.timeout_msec = timeout_msec;
+	}
+
+	read_result await_resume() noexcept
+	{
+		int status = transaction_awaiter::await_resume();
+		return read_result{ status, std::move(values_) };
+	}
+
+private:
+	std::vector<unsigned short> values_;
+};
+
+/* a client driven by an event loop, its calls are awaited instead of blocking */
+class async_client {
+public:
+	async_client(event_loop& loop, const char* ipAddress, unsigned short port) noexcept
+		: loop_(&loop), client_(ipAddress, port)
+	{
+		if (client_ && modbus_tcp_poller_add(loop.get(), client_.get()) < 0) {
+			client_.close();
+		}
+	}
+
+	explicit operator bool() const noexcept { return static_cast<bool>(client_); }
+	modbus_tcp_client* get() const noexcept { return client_.get(); }
+
+	void set_response_timeout(unsigned short timeout_msec) noexcept { client_.set_response_timeout(timeout_msec); }
+	void set_max_inflight(int max_inflight) noexcept { modbus_tcp_client_set_max_inflight(client_.get(), max_inflight); }
+
+	transaction_awaiter read_holding(unsigned short address, span<unsigned short> out,
+		std::stop_token stop = {}, unsigned short timeout_msec = 0) noexcept
+	{
+		return transaction_awaiter(loop_->get(), std::move(stop), timeout_msec, [&](modbus_tcp_transaction_t& t) {
+			modbus_tcp_prepare_read_holding_registers(&t, client_.get(), address, static_cast<unsigned short>(out.size()), out.data());
+		});
+	}
+
+	read_awaiter read_holding(unsigned short address, unsigned short len,
+		std::stop_token stop = {}, unsigned short timeout_msec = 0)
+	{
+		return read_awaiter(loop_->get(), client_.get(), address, len, std::move(stop), timeout_msec);
+	}
+
+	/* data is sent as it is when the transaction goes on the wire, keep it alive until then */
+	transaction_awaiter write_multiple(unsigned short address, span<const unsigned short> data,
+		std::stop_token stop = {}, unsigned short timeout_msec = 0) noexcept
+	{
+		return transaction_awaiter(loop_->get(), std::move(stop), timeout_msec, [&](modbus_tcp_transaction_t& t) {
+			modbus_tcp_prepare_write_multiple_registers(&t, client_.get(), address, static_cast<unsigned short>(data.size()), data.data());
+		});
+	}
+
+	transaction_awaiter read_multiblock(span<const unsigned short> addr, span<const unsigned short> len, span<unsigned short> out,
+		std::stop_token stop = {}, unsigned short timeout_msec = 0) noexcept
+	{
+		/* spans that do not fit prepare no blocks at all, the await then ends with MODBUS_TCP_ERROR */
+		int num_of_block = detail::multiblock_fits(addr, len, out) ? static_cast<int>(addr.size()) : 0;
+
+		return transaction_awaiter(loop_->get(), std::move(stop), timeout_msec, [&](modbus_tcp_transaction_t& t) {
+			modbus_tcp_prepare_read_multiblock_registers(&t, client_.get(), num_of_block,
+				const_cast<unsigned short*>(addr.data()), const_cast<unsigned short*>(len.data()), out.data());
+		});
+	}
+
+	/* acks (empty or one per block) receives the per block acks, keep it, the requests and their buffers alive until it completes */
+	transaction_awaiter read_write_multiblock(span<modbus_tcp_multiblock_request_t> requests, span<unsigned short> acks = {},
+		std::stop_token stop = {}, unsigned short timeout_msec = 0) noexcept
+	{
+		/* too few acks prepares no blocks at all, the await then ends with MODBUS_TCP_ERROR */
+		int num_of_requests = (acks.size() == 0 || acks.size() >= requests.size()) ? static_cast<int>(requests.size()) : 0;
+
+		return transaction_awaiter(loop_->get(), std::move(stop), timeout_msec, [&](modbus_tcp_transaction_t& t) {
+			modbus_tcp_prepare_read_write_multiblock_registers(&t, client_.get(), requests.data(), num_of_requests,
+				acks.size() == 0 ? nullptr : acks.data());
+		});
+	}
+
+	template <typename Map>
+	transaction_awaiter read(typename Map::image& image, std::stop_token stop = {}, unsigned short timeout_msec = 0) noexcept
+	{
+		return read_multiblock(Map::addresses, Map::lengths, image, std::move(stop), timeout_msec);
+	}
+
+private:
+	event_loop* loop_;
+	client client_;
+};
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "modbus_tcp_client.h"
+
+/* registers are compared 8 at a time, one bit per register in a byte per chunk */
+#define CHUNK_REGISTERS 8
+
+struct deadband_point {
+	int offset;
+	int type;
+	int word_order;
+	int mode;
+	double deadband;
+};
+
+struct modbus_tcp_poll_plan {
+	int num_of_block;
+	unsigned short* addr;
+	unsigned short* len;
+	int* block_offset;
+
+	int image_len;
+	int num_of_chunk;
+	unsigned short* image;
+	unsigned short* reported;
+	unsigned char* changed;
+	int primed;
+	int num_of_changes;
+
+	int num_of_point;
+	struct deadband_point* points;
+};
+
+modbus_tcp_poll_plan* modbus_tcp_poll_plan_create(int num_of_block, unsigned short* addr, unsigned short* len)
+{
+	struct modbus_tcp_poll_plan* plan;
+	int image_len = 0;
+	int padded_len;
+	int i;
+
+	/* a plan is read with one 0x65 request, which carries at most 255 blocks */
+	if (num_of_block <= 0 || num_of_block > 255) {
+		printf("poll plan needs 1 to 255 blocks\n");
+		return NULL;
+	}
+
+	for (i=0; i<num_of_block; i++) {
+		image_len += len[i];
+	}
+	if (image_len == 0) {
+		printf("poll plan reads no registers\n");
+		return NULL;
+	}
+
+	plan = calloc(1, sizeof(struct modbus_tcp_poll_plan));
+	if (!plan) return NULL;
+
+	padded_len = (image_len + CHUNK_REGISTERS - 1) / CHUNK_REGISTERS * CHUNK_REGISTERS;
+
+	plan->num_of_block = num_of_block;
+	plan->image_len = image_len;
+	plan->num_of_chunk = padded_len / CHUNK_REGISTERS;
+	plan->addr = malloc(num_of_block * sizeof(unsigned short));
+	plan->len = malloc(num_of_block * sizeof(unsigned short));
+	plan->block_offset = malloc((num_of_block + 1) * sizeof(int));
+	plan->image = calloc(padded_len, sizeof(unsigned short));
+	plan->reported = calloc(padded_len, sizeof(unsigned short));
+	plan->changed = calloc(plan->num_of_chunk, 1);
+
+	if (!plan->addr || !plan->len || !plan->block_offset || !plan->image || !plan->reported || !plan->changed) {
+		modbus_tcp_poll_plan_destroy(plan);
+		return NULL;
+	}
+
+	memcpy(plan->addr, addr, num_of_block * sizeof(unsigned short));
+	memcpy(plan->len, len, num_of_block * sizeof(unsigned short));
+
+	plan->block_offset[0] = 0;
+	for (i=0; i<num_of_block; i++) {
+		plan->block_offset[i+1] = plan->block_offset[i] + len[i];
+	}
+
+	return plan;
+}
+
+void modbus_tcp_poll_plan_destroy(modbus_tcp_poll_plan* plan)
+{
+	if (!plan) return;
+
+	free(plan->addr);
+	free(plan->len);
+	free(plan->block_offset);
+	free(plan->image);
+	free(plan->reported);
+	free(plan->changed);
+	free(plan->points);
+	free(plan);
+}
+
+static int offset_of_address(modbus_tcp_poll_plan* plan, unsigned short address)
+{
+	int i;
+
+	for (i=0; i<plan->num_of_block; i++) {
+		if (address >= plan->addr[i] && address - plan->addr[i] < plan->len[i]) {
+			return plan->block_offset[i] + (address - plan->addr[i]);
+		}
+	}
+
+	return -1;
+}
+
+static int type_words(int type)
+{
+	return (type == MODBUS_TCP_TYPE_UINT16 || type == MODBUS_TCP_TYPE_INT16) ? 1 : 2;
+}
+
+int modbus_tcp_poll_plan_set_deadband(modbus_tcp_poll_plan* plan, unsigned short address, int type, int word_order, int mode, double deadband)
+{
+	struct deadband_point* points;
+	int offset;
+	int i;
+
+	if (type < MODBUS_TCP_TYPE_UINT16 || type > MODBUS_TCP_TYPE_FLOAT32) {
+		printf("deadband type %d unknown\n", type);
+		return -1;
+	}
+
+	if (word_order < MODBUS_TCP_WORD_ORDER_HIGH_FIRST || word_order > MODBUS_TCP_WORD_ORDER_LOW_FIRST) {
+		printf("deadband word order %d unknown\n", word_order);
+		return -1;
+	}
+
+	if (mode < MODBUS_TCP_DEADBAND_ABSOLUTE || mode > MODBUS_TCP_DEADBAND_PERCENT) {
+		printf("deadband mode %d unknown\n", mode);
+		return -1;
+	}
+
+	offset = offset_of_address(plan, address);
+	if (offset < 0) {
+		printf("deadband address %u not in plan\n", address);
+		return -1;
+	}
+
+	if (type_words(type) == 2 && offset_of_address(plan, address + 1) != offset + 1) {
+		printf("deadband value at %u crosses a block boundary\n", address);
+		return -1;
+	}
+
+	for (i=0; i<plan->num_of_point; i++) {
+		if (plan->points[i].offset == offset) {
+			break;
+		}
+	}
+
+	if (i == plan->num_of_point) {
+		points = realloc(plan->points, (plan->num_of_point + 1) * sizeof(struct deadband_point));
+		if (!points) return -1;
+
+		plan->points = points;
+		plan->num_of_point++;
+	}
+
+	plan->points[i].offset = offset;
+	plan->points[i].type = type;
+	plan->points[i].word_order = word_order;
+	plan->points[i].mode = mode;
+	plan->points[i].deadband = deadband;
+
+	return 1;
+}
+
+static double decode_value(const unsigned short* words, int type, int word_order)
+{
+	unsigned int raw;
+	float f;
+
+	if (type_words(type) == 2) {
+		if (word_order == MODBUS_TCP_WORD_ORDER_LOW_FIRST) {
+			raw = ((unsigned int)words[1] << 16) | words[0];
+		} else {
+			raw = ((unsigned int)words[0] << 16) | words[1];
+		}
+	} else {
+		raw = words[0];
+	}
+
+	switch (type) {
+	case MODBUS_TCP_TYPE_INT16:
+		return (short)raw;
+	case MODBUS_TCP_TYPE_UINT32:
+		return raw;
+	case MODBUS_TCP_TYPE_INT32:
+		return (int)raw;
+	case MODBUS_TCP_TYPE_FLOAT32:
+		memcpy(&f, &raw, sizeof(f));
+		return f;
+	default:
+		return raw;
+	}
+}
+
+/* one bit per register of the chunk that differs, straight from the vector compare */
+static unsigned char compare_chunk(const unsigned short* a, const unsigned short* b)
+{
+#if defined(__SSE2__)
+	__m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+
+	/* equal lanes are 0xFFFF, narrowing to bytes keeps one sign bit per register */
+	return ~_mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128())) & 0xFF;
+#elif defined(__ARM_NEON)
+	static const uint8_t weights[CHUNK_REGISTERS] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x8_t differs = vmovn_u16(vmvnq_u16(vceqq_u16(vld1q_u16(a), vld1q_u16(b))));
+	uint8x8_t bits = vand_u8(differs, vld1_u8(weights));
+
+	bits = vpadd_u8(bits, bits);
+	bits = vpadd_u8(bits, bits);
+	bits = vpadd_u8(bits, bits);
+
+	return vget_lane_u8(bits, 0);
+#else
+	unsigned long long x, y, z, w;
+	unsigned char mask = 0;
+	int i;
+
+	memcpy(&x, a, 8);
+	memcpy(&y, b, 8);
+	memcpy(&z, a + 4, 8);
+	memcpy(&w, b + 4, 8);
+	if (x == y && z == w) {
+		return 0;
+	}
+
+	for (i=0; i<CHUNK_REGISTERS; i++) {
+		if (a[i] != b[i]) {
+			mask |= 1 << i;
+		}
+	}
+
+	return mask;
+#endif
+}
+
+static int is_changed(modbus_tcp_poll_plan* plan, int offset)
+{
+	return (plan->changed[offset / CHUNK_REGISTERS] >> (offset % CHUNK_REGISTERS)) & 1;
+}
+
+static void set_changed(modbus_tcp_poll_plan* plan, int offset, int changed)
+{
+	if (changed) {
+		plan->changed[offset / CHUNK_REGISTERS] |= 1 << (offset % CHUNK_REGISTERS);
+	} else {
+		plan->changed[offset / CHUNK_REGISTERS] &= ~(1 << (offset % CHUNK_REGISTERS));
+	}
+}
+
+/*
+ * Compares the image against the last reported values. Changes inside the
+ * deadband of a typed value are dropped and keep their old reported value,
+ * so a slow drift is still reported once it adds up to the deadband.
+ */
+int modbus_tcp_poll_plan_detect_changes(modbus_tcp_poll_plan* plan)
+{
+	int num_of_changes = 0;
+	int i, n;
+
+	if (!plan->primed) {
+		memset(plan->changed, 0xFF, plan->num_of_chunk);
+		if (plan->image_len % CHUNK_REGISTERS) {
+			plan->changed[plan->num_of_chunk - 1] = (1 << (plan->image_len % CHUNK_REGISTERS)) - 1;
+		}
+		memcpy(plan->reported, plan->image, plan->image_len * sizeof(unsigned short));
+		plan->primed = 1;
+		plan->num_of_changes = plan->image_len;
+		return plan->num_of_changes;
+	}
+
+	for (i=0; i<plan->num_of_chunk; i++) {
+		plan->changed[i] = compare_chunk(plan->image + i * CHUNK_REGISTERS, plan->reported + i * CHUNK_REGISTERS);
+	}
+
+	for (i=0; i<plan->num_of_point; i++) {
+		struct deadband_point* point = &plan->points[i];
+		int words = type_words(point->type);
+		double current, reported, band;
+
+		if (!is_changed(plan, point->offset) && (words == 1 || !is_changed(plan, point->offset + 1))) {
+			continue;
+		}
+
+		current = decode_value(plan->image + point->offset, point->type, point->word_order);
+		reported = decode_value(plan->reported + point->offset, point->type, point->word_order);
+
+		band = point->deadband;
+		if (point->mode == MODBUS_TCP_DEADBAND_PERCENT) {
+			band = fabs(reported) * point->deadband / 100;
+		}
+
+		/* nan compares false both ways, report it rather than hide it */
+		n = !(fabs(current - reported) <= band);
+
+		set_changed(plan, point->offset, n);
+		if (words == 2) {
+			set_changed(plan, point->offset + 1, n);
+		}
+	}
+
+	for (i=0; i<plan->num_of_chunk; i++) {
+		unsigned char mask = plan->changed[i];
+
+		for (n=0; mask; n++, mask >>= 1) {
+			if (mask & 1) {
+				plan->reported[i * CHUNK_REGISTERS + n] = plan->image[i * CHUNK_REGISTERS + n];
+				num_of_changes++;
+			}
+		}
+	}
+
+	plan->num_of_changes = num_of_changes;
+
+	return num_of_changes;
+}
+
+int modbus_tcp_poll(modbus_tcp_client* client, modbus_tcp_poll_plan* plan)
+{
+	int res;
+
+	res = modbus_tcp_read_multiblock_registers(client, plan->num_of_block, plan->addr, plan->len, plan->image);
+	if (res <= 0) {
+		return res;
+	}
+
+	modbus_tcp_poll_plan_detect_changes(plan);
+
+	return 1;
+}
+
+void modbus_tcp_prepare_poll_plan(modbus_tcp_transaction_t* t, modbus_tcp_client* client, modbus_tcp_poll_plan* plan, unsigned short* image)
+{
+	modbus_tcp_prepare_read_multiblock_registers(t, client, plan->num_of_block, plan->addr, plan->len, image ? image : plan->image);
+}
+
+int modbus_tcp_poll_plan_num_of_changes(modbus_tcp_poll_plan* plan)
+{
+	return plan->num_of_changes;
+}
+
+/*
+ * Walks the changed registers as runs of consecutive registers within one
+ * block. Start with *cursor = 0, returns 0 when there are no more changes.
+ */
+int modbus_tcp_poll_plan_next_change(modbus_tcp_poll_plan* plan, int* cursor, modbus_tcp_change_t* change)
+{
+	int offset = *cursor;
+	int block = 0;
+	int end;
+
+	while (offset < plan->image_len) {
+		if (plan->changed[offset / CHUNK_REGISTERS] == 0) {
+			offset = (offset / CHUNK_REGISTERS + 1) * CHUNK_REGISTERS;
+			continue;
+		}
+
+		if (is_changed(plan, offset)) {
+			break;
+		}
+
+		offset++;
+	}
+
+	if (offset >= plan->image_len) {
+		*cursor = plan->image_len;
+		return 0;
+	}
+
+	while (plan->block_offset[block + 1] <= offset) {
+		block++;
+	}
+
+	end = offset + 1;
+	while (end < plan->block_offset[block + 1] && is_changed(plan, end)) {
+		end++;
+	}
+
+	change->address = plan->addr[block] + (offset - plan->block_offset[block]);
+	change->length = end - offset;
+	change->value = plan->image + offset;
+
+	*cursor = end;
+
+	return 1;
+}
+
+const unsigned short* modbus_tcp_poll_plan_image(modbus_tcp_poll_plan* plan, int* image_len)
+{
+	if (image_len) {
+		*image_len = plan->image_len;
+	}
+
+	return plan->image;
+}
@@ -0,0 +1,1152 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "modbus_tcp_client.h"
+#include "modbus_tcp_private.h"
+
+#define POLLER_EVENTS 256
+
+/* io_uring : entries, and the receive buffers shared by all clients of a poller */
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+
+/* io_uring user_data : the client pointer with the operation in the low bits, the poller's own for the wakeup */
+#define OP_WAKE 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CANCEL 3
+#define OP_MASK 3
+
+struct modbus_tcp_poller {
+	int backend;
+	int epfd;
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	struct modbus_tcp_uring* ring;
+#endif
+	modbus_tcp_client** clients;
+	int numOfClients;
+	int maxClients;
+	int numOfPending;
+	int numOfCompleted;
+	int running;
+	int wakeFd;
+	int cancelRequested;
+	unsigned long long nextDeadline;
+	unsigned long long nextKeepalive;
+	modbus_tcp_transaction_t* doneHead;
+	modbus_tcp_transaction_t* doneTail;
+	struct epoll_event events[POLLER_EVENTS];
+};
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+/* one shot poll of the wakeup eventfd, armed again each time it fires */
+static int arm_wake(modbus_tcp_poller* poller)
+{
+	struct io_uring_sqe* sqe = modbus_tcp_uring_get_sqe(poller->ring);
+
+	if (!sqe) return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = poller->wakeFd;
+	sqe->poll_events = POLLIN;
+	sqe->user_data = (unsigned long)poller | OP_WAKE;
+
+	return 1;
+}
+#endif
+
+static void prepare(modbus_tcp_transaction_t* t, modbus_tcp_client* client, unsigned char function_code)
+{
+	memset(t, 0, sizeof(*t));
+	t->client = client;
+	t->function_code = function_code;
+	t->priority = MODBUS_TCP_PRIORITY_DEFAULT;
+}
+
+void modbus_tcp_prepare_read_holding_registers(modbus_tcp_transaction_t* t, modbus_tcp_client* client, unsigned short address, unsigned short len, void* buffer)
+{
+	prepare(t, client, 3);
+	t->address = address;
+	t->length = len;
+	t->buffer = buffer;
+}
+
+void modbus_tcp_prepare_write_multiple_registers(modbus_tcp_transaction_t* t, modbus_tcp_client* client, unsigned short address, unsigned short len, const void* data)
+{
+	prepare(t, client, 16);
+	t->address = address;
+	t->length = len;
+	t->buffer = (void*)data;
+}
+
+void modbus_tcp_prepare_read_multiblock_registers(modbus_tcp_transaction_t* t, modbus_tcp_client* client, int num_of_block, unsigned short *addr, unsigned short *len, void* buffer)
+{
+	prepare(t, client, 0x65);
+	t->num_of_block = num_of_block;
+	t->addr = addr;
+	t->len = len;
+	t->buffer = buffer;
+}
+
+void modbus_tcp_prepare_read_write_multiblock_registers(modbus_tcp_transaction_t* t, modbus_tcp_client* client, modbus_tcp_multiblock_request_t* requests, int num_of_requests, unsigned short* acks)
+{
+	prepare(t, client, 0x68);
+	t->num_of_block = num_of_requests;
+	t->buffer = requests;
+	t->acks = acks;
+}
+
+modbus_tcp_poller* modbus_tcp_poller_create(void)
+{
+	return modbus_tcp_poller_create_backend(MODBUS_TCP_POLLER_EPOLL);
+}
+
+modbus_tcp_poller* modbus_tcp_poller_create_backend(int backend)
+{
+	struct modbus_tcp_poller* poller = calloc(1, sizeof(struct modbus_tcp_poller));
+
+	if (!poller) return NULL;
+
+	poller->backend = MODBUS_TCP_POLLER_EPOLL;
+	poller->epfd = -1;
+
+	/* wakes a waiting run for cancel requests of other threads */
+	poller->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (poller->wakeFd < 0) {
+		free(poller);
+		return NULL;
+	}
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	if (backend == MODBUS_TCP_POLLER_IO_URING) {
+		poller->ring = modbus_tcp_uring_create(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+		if (poller->ring) {
+			if (arm_wake(poller) < 0) {
+				modbus_tcp_uring_destroy(poller->ring);
+				poller->ring = NULL;
+			} else {
+				poller->backend = MODBUS_TCP_POLLER_IO_URING;
+				return poller;
+			}
+		}
+	}
+#endif
+
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller->epfd >= 0) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, poller->wakeFd, &ev) == 0) {
+			return poller;
+		}
+		close(poller->epfd);
+	}
+
+	close(poller->wakeFd);
+	free(poller);
+	return NULL;
+}
+
+int modbus_tcp_poller_backend(modbus_tcp_poller* poller)
+{
+	return poller->backend;
+}
+
+void modbus_tcp_poller_destroy(modbus_tcp_poller* poller)
+{
+	if (!poller) return;
+
+	while (poller->numOfClients > 0) {
+		modbus_tcp_poller_remove(poller, poller->clients[poller->numOfClients - 1]);
+	}
+
+	if (poller->epfd >= 0) {
+		close(poller->epfd);
+	}
+	close(poller->wakeFd);
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	modbus_tcp_uring_destroy(poller->ring);
+#endif
+	free(poller->clients);
+	free(poller);
+}
+
+static void set_events(modbus_tcp_client* client, unsigned int events)
+{
+	struct epoll_event ev;
+
+	if (client->events == events || client->failed || client->poller->backend != MODBUS_TCP_POLLER_EPOLL) {
+		return;
+	}
+
+	ev.events = events;
+	ev.data.ptr = client;
+	epoll_ctl(client->poller->epfd, EPOLL_CTL_MOD, client->socket, &ev);
+	client->events = events;
+}
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+static void handle_cqe(void* arg, struct io_uring_cqe* cqe);
+
+static struct io_uring_sqe* client_sqe(modbus_tcp_client* client, int op)
+{
+	struct io_uring_sqe* sqe = modbus_tcp_uring_get_sqe(client->poller->ring);
+
+	if (sqe) {
+		sqe->user_data = (unsigned long)client | op;
+		client->uringOps++;
+	}
+
+	return sqe;
+}
+
+/* multishot recv into the shared buffer ring, or one recv straight into the client's buffer */
+static int arm_recv(modbus_tcp_client* client)
+{
+	struct modbus_tcp_uring* ring = client->poller->ring;
+	struct io_uring_sqe* sqe;
+
+	if (client->recvArmed || client->failed) {
+		return 1;
+	}
+
+	sqe = client_sqe(client, OP_RECV);
+	if (!sqe) return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->socket;
+#if defined(IORING_RECV_MULTISHOT)
+	if (modbus_tcp_uring_multishot(ring)) {
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 1;
+	} else
+#endif
+	{
+		sqe->addr = (unsigned long)(client->rxBuffer + client->rxLength);
+		sqe->len = client->rxSize - client->rxLength;
+	}
+
+	client->recvArmed = 1;
+
+	return 1;
+}
+
+static int start_send(modbus_tcp_client* client)
+{
+	struct io_uring_sqe* sqe;
+
+	if (client->sending || client->txSent == client->txLength) {
+		return 1;
+	}
+
+	sqe = client_sqe(client, OP_SEND);
+	if (!sqe) return -1;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = client->socket;
+	sqe->addr = (unsigned long)(client->txBuffer + client->txSent);
+	sqe->len = client->txLength - client->txSent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	client->sending = 1;
+
+	return 1;
+}
+
+static void cancel_ops(modbus_tcp_client* client)
+{
+	struct io_uring_sqe* sqe;
+
+	if (client->recvArmed && (sqe = client_sqe(client, OP_CANCEL))) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long)client | OP_RECV;
+	}
+
+	if (client->sending && (sqe = client_sqe(client, OP_CANCEL))) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long)client | OP_SEND;
+	}
+}
+#endif
+
+int modbus_tcp_poller_add(modbus_tcp_poller* poller, modbus_tcp_client* client)
+{
+	struct epoll_event ev;
+	int flags;
+	int i;
+
+	if (!poller || !client || client->poller) return -1;
+
+	if (poller->numOfClients == poller->maxClients) {
+		int max_clients = poller->maxClients ? poller->maxClients * 2 : 16;
+		modbus_tcp_client** clients = realloc(poller->clients, max_clients * sizeof(modbus_tcp_client*));
+
+		if (!clients) return -1;
+
+		poller->clients = clients;
+		poller->maxClients = max_clients;
+	}
+
+	flags = fcntl(client->socket, F_GETFL, 0);
+	fcntl(client->socket, F_SETFL, flags | O_NONBLOCK);
+
+	if (poller->backend == MODBUS_TCP_POLLER_EPOLL) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, client->socket, &ev) < 0) {
+			fcntl(client->socket, F_SETFL, flags);
+			return -1;
+		}
+	}
+
+	client->poller = poller;
+	client->pollerIndex = poller->numOfClients;
+	client->failed = 0;
+	client->events = EPOLLIN;
+	client->txLength = 0;
+	client->txSent = 0;
+	client->rxLength = 0;
+	client->inflight = NULL;
+	for (i=0; i<MODBUS_TCP_NUM_OF_PRIORITY; i++) {
+		client->pendingHead[i] = NULL;
+		client->pendingTail[i] = NULL;
+		client->numOfInflight[i] = 0;
+	}
+
+	client->uringOps = 0;
+	client->recvArmed = 0;
+	client->sending = 0;
+
+	client->lastActivityUsec = modbus_tcp_monotonic_usec();
+	if (client->keepaliveUsec) {
+		poller->nextKeepalive = client->lastActivityUsec;
+	}
+
+	poller->clients[poller->numOfClients++] = client;
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	if (poller->backend == MODBUS_TCP_POLLER_IO_URING) {
+		arm_recv(client);
+	}
+#endif
+
+	return 1;
+}
+
+/* completions are queued and only handed to the callbacks once the poller is done touching the clients */
+static void complete(modbus_tcp_poller* poller, modbus_tcp_transaction_t* t, int result)
+{
+	int priority = modbus_tcp_default_priority(t);
+
+	t->result = result;
+	t->state = TRANSACTION_DONE;
+	t->completed_usec = modbus_tcp_monotonic_usec();
+	t->next = NULL;
+
+	t->client->lastActivityUsec = t->completed_usec;
+
+	/* keepalive probes are not traffic of any class */
+	if (result != MODBUS_TCP_CANCELLED && t != &t->client->probe) {
+		modbus_tcp_lane_account(t->client, priority,
+			(t->sent_usec ? t->sent_usec : t->completed_usec) - t->submitted_usec,
+			t->completed_usec - t->submitted_usec);
+	}
+
+	if (poller->doneTail) {
+		poller->doneTail->next = t;
+	} else {
+		poller->doneHead = t;
+	}
+	poller->doneTail = t;
+
+	poller->numOfPending--;
+	poller->numOfCompleted++;
+}
+
+static void dispatch(modbus_tcp_poller* poller)
+{
+	while (poller->doneHead) {
+		modbus_tcp_transaction_t* t = poller->doneHead;
+
+		poller->doneHead = t->next;
+		if (!poller->doneHead) {
+			poller->doneTail = NULL;
+		}
+		t->next = NULL;
+
+		if (t->complete) {
+			t->complete(t);
+		}
+	}
+}
+
+static void unlink_inflight(modbus_tcp_client* client, modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_transaction_t** p;
+
+	for (p = &client->inflight; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			client->numOfInflight[modbus_tcp_default_priority(t)]--;
+			return;
+		}
+	}
+}
+
+static int unlink_pending(modbus_tcp_client* client, modbus_tcp_transaction_t* t)
+{
+	int priority = modbus_tcp_default_priority(t);
+	modbus_tcp_transaction_t* prev = NULL;
+	modbus_tcp_transaction_t* p;
+
+	for (p = client->pendingHead[priority]; p; prev = p, p = p->next) {
+		if (p == t) {
+			if (prev) {
+				prev->next = t->next;
+			} else {
+				client->pendingHead[priority] = t->next;
+			}
+			if (client->pendingTail[priority] == t) {
+				client->pendingTail[priority] = prev;
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* completes everything the client has queued or on the wire */
+static void fail_client(modbus_tcp_client* client, int result)
+{
+	modbus_tcp_poller* poller = client->poller;
+	int i;
+
+	while (client->inflight) {
+		modbus_tcp_transaction_t* t = client->inflight;
+
+		unlink_inflight(client, t);
+		complete(poller, t, result);
+	}
+
+	for (i=0; i<MODBUS_TCP_NUM_OF_PRIORITY; i++) {
+		while (client->pendingHead[i]) {
+			modbus_tcp_transaction_t* t = client->pendingHead[i];
+
+			client->pendingHead[i] = t->next;
+			complete(poller, t, result);
+		}
+		client->pendingTail[i] = NULL;
+	}
+
+	client->txLength = 0;
+	client->txSent = 0;
+	client->rxLength = 0;
+}
+
+static void broken_client(modbus_tcp_client* client)
+{
+	if (!client->failed) {
+		if (client->poller->backend == MODBUS_TCP_POLLER_EPOLL) {
+			epoll_ctl(client->poller->epfd, EPOLL_CTL_DEL, client->socket, NULL);
+		}
+#ifdef MODBUS_TCP_HAVE_IO_URING
+		else {
+			cancel_ops(client);
+		}
+#endif
+		client->failed = 1;
+	}
+
+	fail_client(client, MODBUS_TCP_ERROR);
+}
+
+int modbus_tcp_poller_remove(modbus_tcp_poller* poller, modbus_tcp_client* client)
+{
+	int flags;
+	int last;
+
+	if (!poller || !client || client->poller != poller) return -1;
+
+	fail_client(client, MODBUS_TCP_CANCELLED);
+
+	if (poller->backend == MODBUS_TCP_POLLER_EPOLL) {
+		if (!client->failed) {
+			epoll_ctl(poller->epfd, EPOLL_CTL_DEL, client->socket, NULL);
+		}
+	}
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	else {
+		/* the kernel may still write into the client's buffers, wait for all its operations to end */
+		if (!client->failed) {
+			cancel_ops(client);
+			client->failed = 1;
+		}
+		while (client->uringOps > 0) {
+			if (modbus_tcp_uring_submit_and_wait(poller->ring, -1) < 0) break;
+			modbus_tcp_uring_reap(poller->ring, handle_cqe, poller);
+		}
+	}
+#endif
+
+	flags = fcntl(client->socket, F_GETFL, 0);
+	fcntl(client->socket, F_SETFL, flags & ~O_NONBLOCK);
+
+	last = --poller->numOfClients;
+	poller->clients[client->pollerIndex] = poller->clients[last];
+	poller->clients[client->pollerIndex]->pollerIndex = client->pollerIndex;
+
+	client->poller = NULL;
+
+	if (!poller->running) {
+		dispatch(poller);
+	}
+
+	return 1;
+}
+
+static int flush(modbus_tcp_client* client)
+{
+	while (client->txSent < client->txLength) {
+		int res = send(client->socket, client->txBuffer + client->txSent, client->txLength - client->txSent, MSG_NOSIGNAL);
+
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			set_events(client, EPOLLIN | EPOLLOUT);
+			return 0;
+		}
+
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR) continue;
+			printf("error sending request\n");
+			return -1;
+		}
+
+		MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_SENT, client->txBuffer + client->txSent, res);
+		client->txSent += res;
+	}
+
+	client->txLength = 0;
+	client->txSent = 0;
+	set_events(client, EPOLLIN);
+
+	return 1;
+}
+
+/*
+ * Moves queued transactions onto the wire, most urgent class first. A class
+ * is held back while a more urgent one is still in flight, so bulk reads do
+ * not pile up in front of a control write on the device.
+ */
+static int pump(modbus_tcp_client* client)
+{
+	modbus_tcp_poller* poller = client->poller;
+	int total_inflight = 0;
+	int i;
+
+	for (i=0; i<MODBUS_TCP_NUM_OF_PRIORITY; i++) {
+		total_inflight += client->numOfInflight[i];
+	}
+
+	while (total_inflight < client->maxInflight) {
+		modbus_tcp_transaction_t* t = NULL;
+		int priority;
+		int res;
+
+		for (priority=0; priority<MODBUS_TCP_NUM_OF_PRIORITY; priority++) {
+			if (client->pendingHead[priority]) {
+				t = client->pendingHead[priority];
+				break;
+			}
+			if (client->numOfInflight[priority] > 0) {
+				break;
+			}
+		}
+
+		if (!t) break;
+
+		if (client->txSent > 0 && client->txSent == client->txLength) {
+			client->txLength = 0;
+			client->txSent = 0;
+		}
+
+		res = modbus_tcp_encode_request(client, t, client->txBuffer + client->txLength, client->txSize - client->txLength);
+		if (res == 0 && client->txLength > 0) {
+			break;
+		}
+
+		client->pendingHead[priority] = t->next;
+		if (!client->pendingHead[priority]) {
+			client->pendingTail[priority] = NULL;
+		}
+
+		if (res <= 0) {
+			printf(res == 0 ? "request exceeds frame limit\n" : "invalid request\n");
+			complete(poller, t, MODBUS_TCP_ERROR);
+			continue;
+		}
+
+		client->txLength += res;
+		t->state = TRANSACTION_INFLIGHT;
+		t->sent_usec = modbus_tcp_monotonic_usec();
+		t->next = client->inflight;
+		client->inflight = t;
+		client->numOfInflight[priority]++;
+		total_inflight++;
+	}
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	if (poller->backend == MODBUS_TCP_POLLER_IO_URING) {
+		return start_send(client);
+	}
+#endif
+
+	return flush(client);
+}
+
+int modbus_tcp_poller_submit(modbus_tcp_poller* poller, modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_client* client = t->client;
+	unsigned long long timeout_usec;
+	int priority;
+
+	if (!poller || !client || client->poller != poller) return -1;
+
+	priority = modbus_tcp_default_priority(t);
+	if (priority < 0 || priority >= MODBUS_TCP_NUM_OF_PRIORITY) return -1;
+
+	t->state = TRANSACTION_QUEUED;
+	t->result = MODBUS_TCP_ERROR;
+	t->exception_code = 0;
+	t->submitted_usec = modbus_tcp_monotonic_usec();
+	t->sent_usec = 0;
+	t->completed_usec = 0;
+	t->cancel_requested = 0;
+	t->next = NULL;
+
+	if (t->timeout_msec) {
+		timeout_usec = (unsigned long long)t->timeout_msec * 1000;
+	} else {
+		timeout_usec = (unsigned long long)client->responseTimeout.tv_sec * 1000000 + client->responseTimeout.tv_usec;
+	}
+	t->deadline_usec = t->submitted_usec + timeout_usec;
+	if (poller->numOfPending == 0 || t->deadline_usec < poller->nextDeadline) {
+		poller->nextDeadline = t->deadline_usec;
+	}
+
+	poller->numOfPending++;
+
+	if (client->failed) {
+		complete(poller, t, MODBUS_TCP_ERROR);
+	} else if (modbus_tcp_response_size(t) > client->rxSize) {
+		printf("response exceeds frame limit\n");
+		complete(poller, t, MODBUS_TCP_ERROR);
+	} else {
+		if (client->pendingTail[priority]) {
+			client->pendingTail[priority]->next = t;
+		} else {
+			client->pendingHead[priority] = t;
+		}
+		client->pendingTail[priority] = t;
+
+		if (pump(client) < 0) {
+			broken_client(client);
+		}
+	}
+
+	if (!poller->running) {
+		dispatch(poller);
+	}
+
+	return 1;
+}
+
+int modbus_tcp_poller_cancel(modbus_tcp_poller* poller, modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_client* client = t->client;
+
+	if (!poller || !client || client->poller != poller) return -1;
+
+	if (t->state == TRANSACTION_QUEUED) {
+		unlink_pending(client, t);
+	} else if (t->state == TRANSACTION_INFLIGHT) {
+		/* the reply may still come, it is dropped as an unknown transaction id */
+		unlink_inflight(client, t);
+		modbus_tcp_retire(client, t);
+	} else {
+		return 0;
+	}
+
+	complete(poller, t, MODBUS_TCP_CANCELLED);
+
+	if (pump(client) < 0) {
+		broken_client(client);
+	}
+
+	if (!poller->running) {
+		dispatch(poller);
+	}
+
+	return 1;
+}
+
+int modbus_tcp_poller_cancel_async(modbus_tcp_poller* poller, modbus_tcp_transaction_t* t)
+{
+	unsigned long long one = 1;
+
+	if (!poller) return -1;
+
+	__atomic_store_n(&t->cancel_requested, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&poller->cancelRequested, 1, __ATOMIC_RELEASE);
+
+	if (write(poller->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		return -1;
+	}
+
+	return 1;
+}
+
+static modbus_tcp_transaction_t* find_cancel_requested(modbus_tcp_client* client)
+{
+	modbus_tcp_transaction_t* t;
+	int p;
+
+	for (t = client->inflight; t; t = t->next) {
+		if (__atomic_load_n(&t->cancel_requested, __ATOMIC_RELAXED)) return t;
+	}
+
+	for (p=0; p<MODBUS_TCP_NUM_OF_PRIORITY; p++) {
+		for (t = client->pendingHead[p]; t; t = t->next) {
+			if (__atomic_load_n(&t->cancel_requested, __ATOMIC_RELAXED)) return t;
+		}
+	}
+
+	return NULL;
+}
+
+/* the cancel requests of other threads, from the poller's thread */
+static void cancel_requested(modbus_tcp_poller* poller)
+{
+	unsigned long long value;
+	int i;
+
+	if (read(poller->wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		printf("poller wakeup read fail\n");
+	}
+
+	if (!__atomic_exchange_n(&poller->cancelRequested, 0, __ATOMIC_ACQ_REL)) return;
+
+	for (i=0; i<poller->numOfClients; i++) {
+		modbus_tcp_transaction_t* t;
+
+		/* cancelling pumps the lanes, so the lists are walked again each time */
+		while ((t = find_cancel_requested(poller->clients[i]))) {
+			modbus_tcp_poller_cancel(poller, t);
+		}
+	}
+}
+
+static void parse_frames(modbus_tcp_client* client);
+
+static void receive(modbus_tcp_client* client)
+{
+	for (;;) {
+		int res = recv(client->socket, client->rxBuffer + client->rxLength, client->rxSize - client->rxLength, 0);
+
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR) continue;
+			/* responses that came in with the close still complete */
+			parse_frames(client);
+			if (!client->failed) {
+				broken_client(client);
+			}
+			return;
+		}
+
+		MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_RECEIVED, client->rxBuffer + client->rxLength, res);
+		client->rxLength += res;
+		if (client->rxLength == client->rxSize) {
+			break;
+		}
+	}
+
+	parse_frames(client);
+}
+
+/*
+ * Completes the transactions of every whole frame in the receive buffer.
+ * Bytes that can not start a frame are dropped up to the next plausible
+ * header, failing only the transaction whose frame was broken.
+ */
+static void parse_frames(modbus_tcp_client* client)
+{
+	modbus_tcp_poller* poller = client->poller;
+	int offset = 0;
+
+	while (client->rxLength - offset >= (int)sizeof(struct modbusTcpHeader)) {
+		const unsigned char* frame = client->rxBuffer + offset;
+		modbus_tcp_transaction_t* t = NULL;
+		int length = -1;
+
+		if (modbus_tcp_header_valid(frame, client->rxSize)) {
+			unsigned short transaction_id = (frame[0] << 8) | frame[1];
+
+			for (t = client->inflight; t; t = t->next) {
+				if (t->transaction_id == transaction_id) {
+					break;
+				}
+			}
+
+			/* 0x68 responses are framed by walking their blocks, so the owner is looked up first */
+			if (t) {
+				length = modbus_tcp_response_length(t, frame, client->rxLength - offset);
+			} else {
+				length = modbus_tcp_late_length(client, frame, client->rxLength - offset);
+			}
+		}
+
+		if (length < 0 || length > client->rxSize) {
+			int discarded = modbus_tcp_resync(frame, client->rxLength - offset, client->rxSize);
+
+			printf("stream out of step, %d bytes discarded\n", discarded);
+			modbus_tcp_link_account(client, discarded, 0);
+			if (t) {
+				unlink_inflight(client, t);
+				complete(poller, t, MODBUS_TCP_ERROR);
+			}
+			offset += discarded;
+			continue;
+		}
+
+		if (length == 0 || client->rxLength - offset < length) {
+			break;
+		}
+
+		/* no owner : a late reply to a transaction that timed out or was cancelled */
+		if (t) {
+			unlink_inflight(client, t);
+			complete(poller, t, modbus_tcp_decode_response(t, frame, length));
+		} else {
+			modbus_tcp_link_account(client, 0, 1);
+		}
+
+		offset += length;
+	}
+
+	if (offset > 0) {
+		memmove(client->rxBuffer, client->rxBuffer + offset, client->rxLength - offset);
+		client->rxLength -= offset;
+	}
+}
+
+static void expire(modbus_tcp_poller* poller, unsigned long long now)
+{
+	unsigned long long next = 0;
+	int i, priority;
+
+	for (i=0; i<poller->numOfClients; i++) {
+		modbus_tcp_client* client = poller->clients[i];
+		modbus_tcp_transaction_t* t;
+		modbus_tcp_transaction_t* t_next;
+		int expired = 0;
+
+		for (t = client->inflight; t; t = t_next) {
+			t_next = t->next;
+			if (t->deadline_usec <= now) {
+				unlink_inflight(client, t);
+				modbus_tcp_retire(client, t);
+				complete(poller, t, MODBUS_TCP_TIMEOUT);
+				expired = 1;
+			} else if (!next || t->deadline_usec < next) {
+				next = t->deadline_usec;
+			}
+		}
+
+		for (priority=0; priority<MODBUS_TCP_NUM_OF_PRIORITY; priority++) {
+			for (t = client->pendingHead[priority]; t; t = t_next) {
+				t_next = t->next;
+				if (t->deadline_usec <= now) {
+					unlink_pending(client, t);
+					complete(poller, t, MODBUS_TCP_TIMEOUT);
+				} else if (!next || t->deadline_usec < next) {
+					next = t->deadline_usec;
+				}
+			}
+		}
+
+		if (expired && pump(client) < 0) {
+			broken_client(client);
+		}
+	}
+
+	poller->nextDeadline = next;
+}
+
+static void probe_complete(modbus_tcp_transaction_t* t)
+{
+	if (t->result != MODBUS_TCP_CANCELLED) {
+		modbus_tcp_link_probed(t->client, t);
+	}
+}
+
+static int client_idle(modbus_tcp_client* client)
+{
+	int i;
+
+	if (client->inflight) return 0;
+
+	for (i=0; i<MODBUS_TCP_NUM_OF_PRIORITY; i++) {
+		if (client->pendingHead[i]) return 0;
+	}
+
+	return 1;
+}
+
+/* probes the clients idle for their keepalive time and finds when the next one is due */
+static void keepalive(modbus_tcp_poller* poller, unsigned long long now)
+{
+	unsigned long long next = 0;
+	int i;
+
+	for (i=0; i<poller->numOfClients; i++) {
+		modbus_tcp_client* client = poller->clients[i];
+		unsigned long long due;
+
+		if (!client->keepaliveUsec || client->failed) continue;
+
+		due = client->lastActivityUsec + client->keepaliveUsec;
+		if (!client_idle(client)) {
+			/* its activity moves the due time, look again one period later */
+			due = now + client->keepaliveUsec;
+		} else if (due <= now) {
+			modbus_tcp_transaction_t* t = &client->probe;
+
+			modbus_tcp_prepare_read_holding_registers(t, client, client->keepaliveAddress, 1, &client->probeValue);
+			t->priority = MODBUS_TCP_PRIORITY_BULK;
+			t->complete = probe_complete;
+			modbus_tcp_poller_submit(poller, t);
+			due = now + client->keepaliveUsec;
+		}
+
+		if (!next || due < next) {
+			next = due;
+		}
+	}
+
+	poller->nextKeepalive = next;
+}
+
+void modbus_tcp_client_set_keepalive(modbus_tcp_client* client, unsigned short idle_msec, unsigned short address)
+{
+	client->keepaliveUsec = (unsigned long long)idle_msec * 1000;
+	client->keepaliveAddress = address;
+
+	if (client->poller && client->keepaliveUsec) {
+		client->poller->nextKeepalive = modbus_tcp_monotonic_usec();
+	}
+}
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+static void receive_buffer(modbus_tcp_client* client, const unsigned char* data, int length)
+{
+	MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_RECEIVED, data, length);
+
+	while (length > 0 && !client->failed) {
+		int space = client->rxSize - client->rxLength;
+		int chunk = length < space ? length : space;
+
+		memcpy(client->rxBuffer + client->rxLength, data, chunk);
+		client->rxLength += chunk;
+		data += chunk;
+		length -= chunk;
+
+		parse_frames(client);
+	}
+}
+
+static void handle_cqe(void* arg, struct io_uring_cqe* cqe)
+{
+	modbus_tcp_poller* poller = arg;
+	modbus_tcp_client* client = (modbus_tcp_client*)(unsigned long)(cqe->user_data & ~(unsigned long long)OP_MASK);
+	int op = cqe->user_data & OP_MASK;
+	int res = cqe->res;
+
+	switch (op) {
+	case OP_WAKE:
+		cancel_requested(poller);
+		if (arm_wake(poller) < 0) {
+			printf("poller wakeup arm fail\n");
+		}
+		return;
+
+	case OP_CANCEL:
+		client->uringOps--;
+		return;
+
+	case OP_SEND:
+		client->uringOps--;
+		client->sending = 0;
+
+		if (client->failed) return;
+
+		if (res < 0) {
+			printf("error sending request\n");
+			broken_client(client);
+			return;
+		}
+
+		MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_SENT, client->txBuffer + client->txSent, res);
+		client->txSent += res;
+		if (client->txSent == client->txLength) {
+			client->txLength = 0;
+			client->txSent = 0;
+		}
+		break;
+
+	case OP_RECV:
+#if defined(IORING_CQE_F_MORE)
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+#endif
+		{
+			client->uringOps--;
+			client->recvArmed = 0;
+		}
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (res > 0 && !client->failed) {
+				receive_buffer(client, modbus_tcp_uring_buffer(poller->ring, bid), res);
+			}
+			modbus_tcp_uring_recycle(poller->ring, bid);
+		} else if (res > 0 && !client->failed) {
+			MODBUS_TCP_CAPTURE(client, MODBUS_TCP_CAPTURE_RECEIVED, client->rxBuffer + client->rxLength, res);
+			client->rxLength += res;
+			parse_frames(client);
+		}
+
+		if (client->failed) return;
+
+		if (res == -EINVAL && modbus_tcp_uring_multishot(poller->ring)) {
+			/* buffer rings without multishot recv, receive into the client buffers from now on */
+			modbus_tcp_uring_disable_multishot(poller->ring);
+		} else if (res == 0 || (res < 0 && res != -ENOBUFS && res != -EINTR && res != -EAGAIN)) {
+			broken_client(client);
+			return;
+		}
+
+		if (!client->recvArmed && arm_recv(client) < 0) {
+			broken_client(client);
+			return;
+		}
+		break;
+	}
+
+	if (!client->failed && pump(client) < 0) {
+		broken_client(client);
+	}
+}
+#endif
+
+int modbus_tcp_poller_run(modbus_tcp_poller* poller, int timeout_msec)
+{
+	unsigned long long now = modbus_tcp_monotonic_usec();
+	int completed = poller->numOfCompleted;
+	int num_of_events;
+	int i;
+
+	if (poller->nextKeepalive && poller->nextKeepalive <= now) {
+		keepalive(poller, now);
+	}
+
+	if (poller->numOfPending > 0) {
+		int deadline_msec = 0;
+
+		if (poller->nextDeadline > now) {
+			deadline_msec = (poller->nextDeadline - now + 999) / 1000;
+		}
+		if (timeout_msec < 0 || deadline_msec < timeout_msec) {
+			timeout_msec = deadline_msec;
+		}
+	}
+
+	if (poller->nextKeepalive) {
+		int keepalive_msec = (poller->nextKeepalive - now + 999) / 1000;
+
+		if (timeout_msec < 0 || keepalive_msec < timeout_msec) {
+			timeout_msec = keepalive_msec;
+		}
+	}
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+	if (poller->backend == MODBUS_TCP_POLLER_IO_URING) {
+		/* everything queued by all clients since the last run goes to the kernel in this one call */
+		if (modbus_tcp_uring_submit_and_wait(poller->ring, timeout_msec) < 0) {
+			return -1;
+		}
+
+		poller->running = 1;
+		modbus_tcp_uring_reap(poller->ring, handle_cqe, poller);
+		num_of_events = 0;
+	} else
+#endif
+	{
+		num_of_events = epoll_wait(poller->epfd, poller->events, POLLER_EVENTS, timeout_msec);
+		if (num_of_events < 0 && errno != EINTR) {
+			return -1;
+		}
+
+		poller->running = 1;
+	}
+
+	for (i=0; i<num_of_events; i++) {
+		modbus_tcp_client* client = poller->events[i].data.ptr;
+		unsigned int events = poller->events[i].events;
+
+		if (!client) {
+			cancel_requested(poller);
+			continue;
+		}
+
+		if (client->failed) continue;
+
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			receive(client);
+		}
+
+		if (!client->failed && pump(client) < 0) {
+			broken_client(client);
+		}
+	}
+
+	now = modbus_tcp_monotonic_usec();
+	if (poller->numOfPending > 0 && poller->nextDeadline <= now) {
+		expire(poller, now);
+	}
+
+	poller->running = 0;
+
+	dispatch(poller);
+
+	return poller->numOfCompleted - completed;
+}
+
+int modbus_tcp_poller_pending(modbus_tcp_poller* poller)
+{
+	return poller->numOfPending;
+}
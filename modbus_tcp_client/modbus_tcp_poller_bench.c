@@ -0,0 +1,290 @@
+/*
+ * Poller backend comparison
+ *
+ * Forks a loopback Modbus TCP simulator, then runs the same fan-out polling
+ * scenario through the epoll and the io_uring backend and prints the
+ * throughput and the CPU time the polling process spent.
+ *
+ * usage : modbus_tcp_poller_bench (connections = 1000) (requests per connection = 200) (inflight = 1) (registers = 16)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "modbus_tcp_client.h"
+
+#define SIM_PORT 15020
+#define SIM_BUFFER_SIZE 4096
+
+struct sim_connection {
+	int socket;
+	int length;
+	unsigned char buffer[SIM_BUFFER_SIZE];
+};
+
+/* answers function 3 with register value = address, everything else with an exception */
+static void sim_answer(struct sim_connection* conn)
+{
+	unsigned char out[SIM_BUFFER_SIZE];
+	int offset = 0;
+	int o = 0;
+
+	while (conn->length - offset >= 12) {
+		unsigned char* req = conn->buffer + offset;
+		int frame_len = 6 + ((req[4] << 8) | req[5]);
+		int address = (req[8] << 8) | req[9];
+		int len = (req[10] << 8) | req[11];
+		int i;
+
+		if (conn->length - offset < frame_len) break;
+
+		if (o + 9 + len * 2 > (int)sizeof(out)) break;
+
+		memcpy(out + o, req, 8);
+		if (req[7] == 3 && len <= 125) {
+			out[o + 4] = (3 + len * 2) >> 8;
+			out[o + 5] = 3 + len * 2;
+			out[o + 8] = len * 2;
+			for (i=0; i<len; i++) {
+				out[o + 9 + i*2] = (address + i) >> 8;
+				out[o + 10 + i*2] = address + i;
+			}
+			o += 9 + len * 2;
+		} else {
+			out[o + 4] = 0;
+			out[o + 5] = 3;
+			out[o + 7] |= 0x80;
+			out[o + 8] = 1;
+			o += 9;
+		}
+
+		offset += frame_len;
+	}
+
+	memmove(conn->buffer, conn->buffer + offset, conn->length - offset);
+	conn->length -= offset;
+
+	if (o > 0) {
+		send(conn->socket, out, o, MSG_NOSIGNAL);
+	}
+}
+
+static void simulator(int listen_socket)
+{
+	struct epoll_event ev, events[256];
+	int epfd = epoll_create1(0);
+	int i, n;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_socket, &ev);
+
+	for (;;) {
+		n = epoll_wait(epfd, events, 256, -1);
+
+		for (i=0; i<n; i++) {
+			struct sim_connection* conn = events[i].data.ptr;
+
+			if (!conn) {
+				int s = accept(listen_socket, NULL, NULL);
+				int one = 1;
+
+				if (s < 0) continue;
+
+				setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				conn = calloc(1, sizeof(struct sim_connection));
+				conn->socket = s;
+				ev.events = EPOLLIN;
+				ev.data.ptr = conn;
+				epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+				continue;
+			}
+
+			int res = recv(conn->socket, conn->buffer + conn->length, SIM_BUFFER_SIZE - conn->length, 0);
+			if (res <= 0) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, conn->socket, NULL);
+				close(conn->socket);
+				free(conn);
+				continue;
+			}
+
+			conn->length += res;
+			sim_answer(conn);
+		}
+	}
+}
+
+struct device {
+	modbus_tcp_client* client;
+	modbus_tcp_transaction_t* transactions;
+	unsigned short* buffers;
+	int remaining;
+};
+
+static int registers = 16;
+static int errors = 0;
+static modbus_tcp_poller* poller;
+
+static void on_complete(modbus_tcp_transaction_t* t)
+{
+	struct device* dev = t->user_data;
+
+	if (t->result != MODBUS_TCP_OK || ((unsigned short*)t->buffer)[0] != t->address) {
+		errors++;
+	}
+
+	if (dev->remaining > 0) {
+		dev->remaining--;
+		modbus_tcp_poller_submit(poller, t);
+	}
+}
+
+static double elapsed(struct timespec* a, struct timespec* b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int run(int backend, int connections, int requests, int inflight)
+{
+	struct device* devices = calloc(connections, sizeof(struct device));
+	struct timespec start, end;
+	double cpu_start, cpu;
+	int total = connections * requests;
+	int i, j;
+
+	poller = modbus_tcp_poller_create_backend(backend);
+	if (!poller) {
+		printf("poller create fail\n");
+		return -1;
+	}
+
+	if (modbus_tcp_poller_backend(poller) != backend) {
+		printf("io_uring not available, skipped\n");
+		modbus_tcp_poller_destroy(poller);
+		free(devices);
+		return 0;
+	}
+
+	for (i=0; i<connections; i++) {
+		struct device* dev = &devices[i];
+
+		dev->client = modbus_tcp_client_open("127.0.0.1", SIM_PORT);
+		if (!dev->client) {
+			printf("open fail %d\n", i);
+			return -1;
+		}
+		modbus_tcp_client_set_max_inflight(dev->client, inflight);
+		modbus_tcp_poller_add(poller, dev->client);
+
+		dev->transactions = calloc(inflight, sizeof(modbus_tcp_transaction_t));
+		dev->buffers = calloc(inflight * registers, sizeof(unsigned short));
+		dev->remaining = requests - inflight;
+	}
+
+	errors = 0;
+	cpu_start = cpu_seconds();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i=0; i<connections; i++) {
+		struct device* dev = &devices[i];
+
+		for (j=0; j<inflight; j++) {
+			modbus_tcp_transaction_t* t = &dev->transactions[j];
+
+			modbus_tcp_prepare_read_holding_registers(t, dev->client, (i * 7 + j) % 60000, registers, dev->buffers + j * registers);
+			t->complete = on_complete;
+			t->user_data = dev;
+			modbus_tcp_poller_submit(poller, t);
+		}
+	}
+
+	while (modbus_tcp_poller_pending(poller) > 0) {
+		modbus_tcp_poller_run(poller, -1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cpu = cpu_seconds() - cpu_start;
+
+	printf("%-9s %8d requests %7.3f s %10.0f req/s  cpu %6.3f s  %6.2f us cpu/req  errors %d\n",
+		backend == MODBUS_TCP_POLLER_IO_URING ? "io_uring" : "epoll",
+		total, elapsed(&start, &end), total / elapsed(&start, &end), cpu, cpu * 1e6 / total, errors);
+
+	for (i=0; i<connections; i++) {
+		modbus_tcp_client_close(devices[i].client);
+		free(devices[i].transactions);
+		free(devices[i].buffers);
+	}
+	free(devices);
+	modbus_tcp_poller_destroy(poller);
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int connections = argc > 1 ? atoi(argv[1]) : 1000;
+	int requests = argc > 2 ? atoi(argv[2]) : 200;
+	int inflight = argc > 3 ? atoi(argv[3]) : 1;
+	struct sockaddr_in sa;
+	struct rlimit rl;
+	int listen_socket;
+	int one = 1;
+	pid_t pid;
+
+	if (argc > 4) registers = atoi(argv[4]);
+	if (inflight < 1) inflight = 1;
+	if (requests < inflight) requests = inflight;
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(SIM_PORT);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(listen_socket, 4096) < 0) {
+		printf("simulator bind fail\n");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		simulator(listen_socket);
+		exit(0);
+	}
+	close(listen_socket);
+
+	printf("%d connections x %d requests, %d in flight, %d registers\n", connections, requests, inflight, registers);
+
+	run(MODBUS_TCP_POLLER_EPOLL, connections, requests, inflight);
+	run(MODBUS_TCP_POLLER_IO_URING, connections, requests, inflight);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	return 0;
+}
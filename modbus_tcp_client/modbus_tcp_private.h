@@ -0,0 +1,138 @@
+#ifndef _MODBUS_TCP_PRIVATE_H_
+#define _MODBUS_TCP_PRIVATE_H_
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "modbus_tcp_client.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MODBUS_TCP_HAVE_IO_URING
+#endif
+#endif
+
+enum transaction_state {
+	TRANSACTION_IDLE,
+	TRANSACTION_QUEUED,
+	TRANSACTION_INFLIGHT,
+	TRANSACTION_DONE,
+};
+
+struct modbusTcpHeader {
+	unsigned short transaction_id;
+	unsigned short protocol_id;
+	unsigned short length;
+	unsigned char unit_id;
+	unsigned char function_code;
+};
+
+/* 0x68 layout of a transaction that ended before its reply came, see modbus_tcp_retire */
+#define MODBUS_TCP_RETIRED_SLOTS 4
+
+struct modbus_tcp_retired {
+	unsigned short transactionId;
+	int numOfBlock;
+	unsigned long long expiresUsec;
+	/* registers each block reads, 0 for a write block */
+	unsigned short* readLength;
+};
+
+struct modbus_tcp_client {
+	int socket;
+	struct timeval responseTimeout;
+	unsigned short transactionId;
+
+	/* frame arena : txSize bytes of request, rxSize bytes of response, then the retired layouts */
+	unsigned char* arena;
+	int txSize;
+	int rxSize;
+
+	/* late 0x68 replies are framed with these, free when numOfBlock is 0 */
+	struct modbus_tcp_retired retired[MODBUS_TCP_RETIRED_SLOTS];
+	int nextRetired;
+	int maxRetiredBlocks;
+
+	/* priority lanes : one transaction on the wire at a time, lower class first */
+	pthread_mutex_t laneLock;
+	pthread_cond_t laneCond;
+	int laneBusy;
+	int laneWaiting[MODBUS_TCP_NUM_OF_PRIORITY];
+	modbus_tcp_latency_stats_t laneStats[MODBUS_TCP_NUM_OF_PRIORITY];
+
+	/* non-blocking transactions, see modbus_tcp_poller.c */
+	struct modbus_tcp_poller* poller;
+	int pollerIndex;
+	int failed;
+	unsigned int events;
+	unsigned char* txBuffer;
+	int txLength;
+	int txSent;
+	unsigned char* rxBuffer;
+	int rxLength;
+	modbus_tcp_transaction_t* pendingHead[MODBUS_TCP_NUM_OF_PRIORITY];
+	modbus_tcp_transaction_t* pendingTail[MODBUS_TCP_NUM_OF_PRIORITY];
+	modbus_tcp_transaction_t* inflight;
+	int numOfInflight[MODBUS_TCP_NUM_OF_PRIORITY];
+	int maxInflight;
+
+	/* io_uring backend : operations the kernel still holds for this client */
+	int uringOps;
+	int recvArmed;
+	int sending;
+
+	/* wire capture, see modbus_tcp_capture.c */
+	modbus_tcp_capture* capture;
+	unsigned int captureConnection;
+
+	/* link health, guarded by laneLock */
+	modbus_tcp_link_stats_t linkStats;
+
+	/* keepalive probe on a poller */
+	unsigned long long keepaliveUsec;
+	unsigned long long lastActivityUsec;
+	unsigned short keepaliveAddress;
+	unsigned short probeValue;
+	modbus_tcp_transaction_t probe;
+};
+
+unsigned long long modbus_tcp_monotonic_usec(void);
+int modbus_tcp_default_priority(modbus_tcp_transaction_t* transaction);
+void modbus_tcp_lane_account(modbus_tcp_client* client, int priority, unsigned int wait, unsigned int latency);
+void modbus_tcp_link_account(modbus_tcp_client* client, int discarded, int late_replies);
+void modbus_tcp_link_probed(modbus_tcp_client* client, modbus_tcp_transaction_t* probe);
+
+void modbus_tcp_capture_write(modbus_tcp_capture* capture, unsigned int connection, int direction, const void* data, int length);
+
+#define MODBUS_TCP_CAPTURE(client, direction, data, length) \
+	do { \
+		if ((client)->capture) \
+			modbus_tcp_capture_write((client)->capture, (client)->captureConnection, (direction), (data), (length)); \
+	} while (0)
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+struct modbus_tcp_uring;
+
+struct modbus_tcp_uring* modbus_tcp_uring_create(unsigned int entries, unsigned int buf_count, unsigned int buf_size);
+void modbus_tcp_uring_destroy(struct modbus_tcp_uring* ring);
+struct io_uring_sqe* modbus_tcp_uring_get_sqe(struct modbus_tcp_uring* ring);
+int modbus_tcp_uring_submit_and_wait(struct modbus_tcp_uring* ring, int timeout_msec);
+int modbus_tcp_uring_reap(struct modbus_tcp_uring* ring, void (*handle)(void* arg, struct io_uring_cqe* cqe), void* arg);
+int modbus_tcp_uring_multishot(struct modbus_tcp_uring* ring);
+void modbus_tcp_uring_disable_multishot(struct modbus_tcp_uring* ring);
+unsigned char* modbus_tcp_uring_buffer(struct modbus_tcp_uring* ring, unsigned int bid);
+void modbus_tcp_uring_recycle(struct modbus_tcp_uring* ring, unsigned int bid);
+#endif
+
+/* frame codec for the non-blocking transactions */
+int modbus_tcp_encode_request(modbus_tcp_client* client, modbus_tcp_transaction_t* transaction, unsigned char* frame, int size);
+int modbus_tcp_response_size(modbus_tcp_transaction_t* transaction);
+int modbus_tcp_response_length(modbus_tcp_transaction_t* transaction, const unsigned char* frame, int available);
+void modbus_tcp_retire(modbus_tcp_client* client, modbus_tcp_transaction_t* transaction);
+int modbus_tcp_late_length(modbus_tcp_client* client, const unsigned char* frame, int available);
+int modbus_tcp_decode_response(modbus_tcp_transaction_t* transaction, const unsigned char* frame, int length);
+int modbus_tcp_header_valid(const unsigned char* frame, int max_length);
+int modbus_tcp_resync(const unsigned char* data, int available, int max_length);
+
+#endif
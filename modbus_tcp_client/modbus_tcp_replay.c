@@ -0,0 +1,274 @@
+/*
+ * Capture replay
+ *
+ * Plays a capture written by modbus_tcp_capture_open() back as the device :
+ * the n-th accepted connection replays the n-th captured connection. What the
+ * client sent is read from the peer and compared, what it received is sent
+ * back with the captured timing, split exactly as it arrived, so slow or
+ * fragmented responses and odd frames reproduce as well. The client under
+ * test should issue the captured requests in the same order on a fresh
+ * connection, then transaction ids match too.
+ *
+ * usage : modbus_tcp_replay <capture file> (port = 502) (speed = 1, 0 = no delays)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "modbus_tcp_client.h"
+
+struct connection {
+	unsigned int id;
+	int socket;
+	int num_of_record;
+	int num_of_mismatch;
+	unsigned long long bytes;
+	pthread_t thread;
+};
+
+static unsigned char* capture;
+static long capture_size;
+static double speed = 1.0;
+
+static unsigned long long monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long nsec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* calls f for every record, stops when f returns < 0 */
+static int for_each_record(int (*f)(modbus_tcp_capture_record_t* record, const unsigned char* data, void* arg), void* arg)
+{
+	long offset = sizeof(modbus_tcp_capture_file_header_t);
+
+	while (offset + (long)sizeof(modbus_tcp_capture_record_t) <= capture_size) {
+		modbus_tcp_capture_record_t* record = (modbus_tcp_capture_record_t*)(capture + offset);
+		const unsigned char* data = capture + offset + sizeof(modbus_tcp_capture_record_t);
+
+		if (offset + (long)sizeof(modbus_tcp_capture_record_t) + record->length > capture_size) {
+			printf("capture truncated\n");
+			break;
+		}
+
+		if (f(record, data, arg) < 0) return -1;
+
+		offset += sizeof(modbus_tcp_capture_record_t) + record->length;
+	}
+
+	return 0;
+}
+
+static int read_exact(int socket, unsigned char* buffer, int length)
+{
+	int received = 0;
+
+	while (received < length) {
+		int res = recv(socket, buffer + received, length - received, 0);
+
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		received += res;
+	}
+
+	return length;
+}
+
+struct replay_state {
+	struct connection* conn;
+	unsigned long long anchor_nsec;
+	unsigned long long anchor_capture_nsec;
+};
+
+static int replay_record(modbus_tcp_capture_record_t* record, const unsigned char* data, void* arg)
+{
+	struct replay_state* state = arg;
+	struct connection* conn = state->conn;
+	unsigned char buffer[0x10000];
+
+	if (record->connection != conn->id) return 0;
+
+	if (!state->anchor_nsec) {
+		state->anchor_nsec = monotonic_nsec();
+		state->anchor_capture_nsec = record->timestamp_nsec;
+	}
+
+	if (record->direction == MODBUS_TCP_CAPTURE_SENT) {
+		if (read_exact(conn->socket, buffer, record->length) < 0) {
+			printf("connection %u : client closed after %d records\n", conn->id, conn->num_of_record);
+			return -1;
+		}
+		if (memcmp(buffer, data, record->length) != 0) {
+			conn->num_of_mismatch++;
+		}
+
+		/* the device's response time counts from when the request really arrived */
+		state->anchor_nsec = monotonic_nsec();
+		state->anchor_capture_nsec = record->timestamp_nsec;
+	} else {
+		if (speed > 0) {
+			sleep_until(state->anchor_nsec + (record->timestamp_nsec - state->anchor_capture_nsec) / speed);
+		}
+		if (send(conn->socket, data, record->length, MSG_NOSIGNAL) != record->length) {
+			printf("connection %u : send fail after %d records\n", conn->id, conn->num_of_record);
+			return -1;
+		}
+	}
+
+	conn->num_of_record++;
+	conn->bytes += record->length;
+
+	return 0;
+}
+
+static void* replay(void* arg)
+{
+	struct replay_state state = { arg, 0, 0 };
+
+	for_each_record(replay_record, &state);
+	close(state.conn->socket);
+
+	return NULL;
+}
+
+struct connection_list {
+	struct connection* conn;
+	int count;
+};
+
+static int collect_connection(modbus_tcp_capture_record_t* record, const unsigned char* data, void* arg)
+{
+	struct connection_list* list = arg;
+	int i;
+
+	for (i=0; i<list->count; i++) {
+		if (list->conn[i].id == record->connection) return 0;
+	}
+
+	list->conn = realloc(list->conn, (list->count + 1) * sizeof(struct connection));
+	memset(&list->conn[list->count], 0, sizeof(struct connection));
+	list->conn[list->count].id = record->connection;
+	list->count++;
+
+	return 0;
+}
+
+static int load(const char* path)
+{
+	modbus_tcp_capture_file_header_t* header;
+	FILE* file = fopen(path, "rb");
+
+	if (!file) {
+		printf("can not open %s\n", path);
+		return -1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	capture_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	capture = malloc(capture_size > 0 ? capture_size : 1);
+	if (!capture || fread(capture, 1, capture_size, file) != (size_t)capture_size) {
+		printf("can not read %s\n", path);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	header = (modbus_tcp_capture_file_header_t*)capture;
+	if (capture_size < (long)sizeof(*header) || memcmp(header->magic, MODBUS_TCP_CAPTURE_MAGIC, sizeof(header->magic)) != 0) {
+		printf("%s is not a capture\n", path);
+		return -1;
+	}
+	if (header->version != MODBUS_TCP_CAPTURE_VERSION) {
+		printf("capture version %u not supported\n", header->version);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	struct connection_list list = { NULL, 0 };
+	struct sockaddr_in sa;
+	unsigned short port = 502;
+	int listen_socket;
+	int one = 1;
+	int i;
+
+	if (argc < 2) {
+		printf("usage : %s <capture file> (port = 502) (speed = 1, 0 = no delays)\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2) port = atoi(argv[2]);
+	if (argc > 3) speed = atof(argv[3]);
+
+	if (load(argv[1]) < 0) return 1;
+
+	for_each_record(collect_connection, &list);
+	if (list.count == 0) {
+		printf("no records\n");
+		return 1;
+	}
+
+	listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(listen_socket, 64) < 0) {
+		printf("bind fail\n");
+		return 1;
+	}
+
+	printf("%d connections, listening on %d\n", list.count, port);
+
+	for (i=0; i<list.count; i++) {
+		struct connection* conn = &list.conn[i];
+
+		conn->socket = accept(listen_socket, NULL, NULL);
+		if (conn->socket < 0) {
+			printf("accept fail\n");
+			return 1;
+		}
+		setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_create(&conn->thread, NULL, replay, conn);
+	}
+	close(listen_socket);
+
+	for (i=0; i<list.count; i++) {
+		struct connection* conn = &list.conn[i];
+
+		pthread_join(conn->thread, NULL);
+		printf("connection %u : %d records, %llu bytes, %d requests differ\n",
+			conn->id, conn->num_of_record, conn->bytes, conn->num_of_mismatch);
+	}
+
+	free(list.conn);
+	free(capture);
+
+	return 0;
+}
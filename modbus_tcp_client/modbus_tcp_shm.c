@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus_tcp_client.h"
+
+/* slots start on their own cache line so publishing one device does not disturb readers of the next */
+#define SLOT_ALIGN 64
+/* a publisher that died inside a write leaves its slot odd forever */
+#define STUCK_SPINS 1000
+#define STUCK_YIELDS 100000
+
+struct modbus_tcp_shm {
+	unsigned char* base;
+	size_t size;
+	int fd;
+	int owner;
+	char name[256];
+	/* the layout as last validated, a reader never trusts the live header for it */
+	unsigned int generation;
+	unsigned int headerSize;
+	unsigned int deviceSize;
+	unsigned int numOfDevice;
+	unsigned int maxRegisters;
+	unsigned int imageOffset;
+};
+
+static unsigned long long clock_nsec(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static modbus_tcp_shm_header_t* header_of(modbus_tcp_shm* shm)
+{
+	return (modbus_tcp_shm_header_t*)shm->base;
+}
+
+static modbus_tcp_shm_device_t* slot_of(modbus_tcp_shm* shm, int device)
+{
+	if (device < 0 || device >= (int)shm->numOfDevice) return NULL;
+
+	return (modbus_tcp_shm_device_t*)(shm->base + shm->headerSize + (size_t)device * shm->deviceSize);
+}
+
+static unsigned short* image_of(modbus_tcp_shm* shm, modbus_tcp_shm_device_t* slot)
+{
+	return (unsigned short*)((unsigned char*)slot + shm->imageOffset);
+}
+
+modbus_tcp_shm* modbus_tcp_shm_create(const char* name, int num_of_device, int max_registers)
+{
+	struct modbus_tcp_shm* shm;
+	modbus_tcp_shm_header_t* header;
+	unsigned int header_size = (sizeof(modbus_tcp_shm_header_t) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+	unsigned int device_size;
+	unsigned int generation = 0;
+	struct stat st;
+	int fd;
+
+	if (num_of_device <= 0 || max_registers < 0 || strlen(name) >= sizeof(shm->name)) return NULL;
+
+	device_size = (sizeof(modbus_tcp_shm_device_t) + max_registers * sizeof(unsigned short) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+
+	shm = calloc(1, sizeof(struct modbus_tcp_shm));
+	if (!shm) return NULL;
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		printf("shm_open %s fail\n", name);
+		free(shm);
+		return NULL;
+	}
+
+	shm->size = header_size + (size_t)num_of_device * device_size;
+
+	/*
+	 * A segment left behind by an earlier run is invalidated before it is
+	 * resized, its readers stop at the magic. It never shrinks : a reader
+	 * still inside a slot past the new end would fault.
+	 */
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(modbus_tcp_shm_header_t)) {
+		header = mmap(NULL, sizeof(modbus_tcp_shm_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (header != MAP_FAILED) {
+			if (__atomic_exchange_n(&header->magic, 0, __ATOMIC_ACQ_REL) == MODBUS_TCP_SHM_MAGIC) {
+				generation = header->generation;
+			}
+			munmap(header, sizeof(modbus_tcp_shm_header_t));
+		}
+		if ((size_t)st.st_size > shm->size) {
+			shm->size = st.st_size;
+		}
+	}
+
+	if (ftruncate(fd, shm->size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		free(shm);
+		return NULL;
+	}
+
+	shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->base == MAP_FAILED) {
+		shm_unlink(name);
+		free(shm);
+		return NULL;
+	}
+
+	shm->fd = -1;
+	shm->owner = 1;
+	strcpy(shm->name, name);
+	shm->generation = generation + 1;
+	shm->headerSize = header_size;
+	shm->deviceSize = device_size;
+	shm->numOfDevice = num_of_device;
+	shm->maxRegisters = max_registers;
+	shm->imageOffset = sizeof(modbus_tcp_shm_device_t);
+
+	/* invalid until the new layout is complete */
+	header = header_of(shm);
+	__atomic_store_n(&header->magic, 0, __ATOMIC_RELEASE);
+	memset(shm->base + sizeof(header->magic), 0, shm->size - sizeof(header->magic));
+
+	header->version_major = MODBUS_TCP_SHM_VERSION_MAJOR;
+	header->version_minor = MODBUS_TCP_SHM_VERSION_MINOR;
+	header->header_size = header_size;
+	header->device_size = device_size;
+	header->num_of_device = num_of_device;
+	header->max_registers = max_registers;
+	header->image_offset = shm->imageOffset;
+	header->generation = shm->generation;
+	header->created_realtime_nsec = clock_nsec(CLOCK_REALTIME);
+	__atomic_store_n(&header->magic, MODBUS_TCP_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return shm;
+}
+
+void modbus_tcp_shm_destroy(modbus_tcp_shm* shm)
+{
+	if (!shm) return;
+
+	if (shm->base) {
+		munmap(shm->base, shm->size);
+	}
+	if (shm->fd >= 0) {
+		close(shm->fd);
+	}
+	if (shm->owner) {
+		shm_unlink(shm->name);
+	}
+	free(shm);
+}
+
+static void write_begin(modbus_tcp_shm_device_t* slot)
+{
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(modbus_tcp_shm_device_t* slot)
+{
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+int modbus_tcp_shm_set_device(modbus_tcp_shm* shm, int device, const char* name)
+{
+	modbus_tcp_shm_device_t* slot;
+
+	if (!shm || !shm->owner || !(slot = slot_of(shm, device))) return -1;
+
+	write_begin(slot);
+	strncpy(slot->name, name, sizeof(slot->name) - 1);
+	write_end(slot);
+
+	return 1;
+}
+
+/* only one thread may publish a given device */
+int modbus_tcp_shm_publish(modbus_tcp_shm* shm, int device, modbus_tcp_client* client, const unsigned short* image, int image_len, int status, unsigned int scan_usec)
+{
+	modbus_tcp_shm_device_t* slot;
+	modbus_tcp_latency_stats_t latency[MODBUS_TCP_NUM_OF_PRIORITY];
+	int i;
+
+	if (!shm || !shm->owner || !(slot = slot_of(shm, device))) return -1;
+
+	if (image_len < 0 || image_len > (int)shm->maxRegisters) {
+		printf("image exceeds shm slot\n");
+		return -1;
+	}
+
+	/* the lane lock is taken here, outside the write section */
+	memset(latency, 0, sizeof(latency));
+	if (client) {
+		for (i=0; i<MODBUS_TCP_NUM_OF_PRIORITY; i++) {
+			modbus_tcp_client_get_latency_stats(client, i, &latency[i]);
+		}
+	}
+
+	write_begin(slot);
+
+	slot->status = status;
+	slot->scan_usec = scan_usec;
+	slot->scan_realtime_nsec = clock_nsec(CLOCK_REALTIME);
+	slot->scan_monotonic_nsec = clock_nsec(CLOCK_MONOTONIC);
+	slot->scans++;
+	if (status < 0) {
+		slot->errors++;
+		slot->consecutive_errors++;
+	} else {
+		if (status == 0) {
+			slot->exceptions++;
+		}
+		slot->consecutive_errors = 0;
+	}
+	memcpy(slot->latency, latency, sizeof(latency));
+
+	/* a failed scan keeps the last good image */
+	if (status > 0 && image) {
+		slot->image_len = image_len;
+		memcpy(image_of(shm, slot), image, image_len * sizeof(unsigned short));
+	}
+
+	write_end(slot);
+
+	return 1;
+}
+
+/* maps the segment at its current size and validates the layout it holds now */
+static int attach(modbus_tcp_shm* shm)
+{
+	modbus_tcp_shm_header_t header;
+	unsigned char* base;
+	struct stat st;
+
+	/* nothing of the old layout is used again until the new one is validated */
+	shm->numOfDevice = 0;
+	shm->maxRegisters = 0;
+
+	if (fstat(shm->fd, &st) < 0 || st.st_size < (off_t)sizeof(modbus_tcp_shm_header_t)) return -1;
+
+	if (!shm->base || shm->size != (size_t)st.st_size) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, shm->fd, 0);
+		if (base == MAP_FAILED) return -1;
+		if (shm->base) {
+			munmap(shm->base, shm->size);
+		}
+		shm->base = base;
+		shm->size = st.st_size;
+	}
+
+	header.magic = __atomic_load_n(&header_of(shm)->magic, __ATOMIC_ACQUIRE);
+	memcpy((char*)&header + sizeof(header.magic), shm->base + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+
+	if (header.magic != MODBUS_TCP_SHM_MAGIC || header.version_major != MODBUS_TCP_SHM_VERSION_MAJOR
+	 || header.header_size < sizeof(modbus_tcp_shm_header_t)
+	 || header.image_offset < sizeof(unsigned int) || header.image_offset % sizeof(unsigned short)
+	 || header.image_offset + (size_t)header.max_registers * sizeof(unsigned short) > header.device_size
+	 || header.header_size + (size_t)header.num_of_device * header.device_size > shm->size) {
+		return -1;
+	}
+
+	/* a publisher restarting meanwhile may have rewritten the header under the copy */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&header_of(shm)->magic, __ATOMIC_RELAXED) != MODBUS_TCP_SHM_MAGIC
+	 || __atomic_load_n(&header_of(shm)->generation, __ATOMIC_RELAXED) != header.generation) {
+		return -1;
+	}
+
+	shm->headerSize = header.header_size;
+	shm->deviceSize = header.device_size;
+	shm->numOfDevice = header.num_of_device;
+	shm->maxRegisters = header.max_registers;
+	shm->imageOffset = header.image_offset;
+	shm->generation = header.generation;
+
+	return 1;
+}
+
+/* a reader follows a restarted publisher to its new layout */
+static int refresh(modbus_tcp_shm* shm)
+{
+	modbus_tcp_shm_header_t* header = header_of(shm);
+
+	if (shm->owner) return 1;
+
+	/* the publisher is restarting, the segment may be shrinking */
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != MODBUS_TCP_SHM_MAGIC) return -1;
+
+	if (__atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) == shm->generation) return 1;
+
+	return attach(shm);
+}
+
+modbus_tcp_shm* modbus_tcp_shm_open(const char* name)
+{
+	struct modbus_tcp_shm* shm;
+	int fd;
+
+	if (strlen(name) >= sizeof(shm->name)) return NULL;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+
+	shm = calloc(1, sizeof(struct modbus_tcp_shm));
+	if (!shm) {
+		close(fd);
+		return NULL;
+	}
+
+	shm->fd = fd;
+	strcpy(shm->name, name);
+
+	if (attach(shm) < 0) {
+		printf("shm %s : layout not supported\n", name);
+		modbus_tcp_shm_close(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+void modbus_tcp_shm_close(modbus_tcp_shm* shm)
+{
+	modbus_tcp_shm_destroy(shm);
+}
+
+const modbus_tcp_shm_header_t* modbus_tcp_shm_layout(modbus_tcp_shm* shm)
+{
+	return header_of(shm);
+}
+
+int modbus_tcp_shm_read(modbus_tcp_shm* shm, int device, modbus_tcp_shm_device_t* info, unsigned short* image, int max_len)
+{
+	modbus_tcp_shm_device_t* slot;
+	unsigned int begin, end;
+	unsigned int locked = 0;
+	int max_registers;
+	int stuck = 0;
+	int len;
+
+	if (!shm || refresh(shm) < 0 || !(slot = slot_of(shm, device))) return -1;
+
+	max_registers = shm->maxRegisters;
+	if (max_len > max_registers) max_len = max_registers;
+
+	/* fields a publisher of an older minor version does not have read as zero */
+	if (info) {
+		memset(info, 0, sizeof(*info));
+	}
+
+	for (;;) {
+		begin = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (begin & 1) {
+			/* only a sequence that does not move at all counts as stuck */
+			stuck = (begin == locked) ? stuck + 1 : 0;
+			locked = begin;
+			if (stuck >= STUCK_SPINS + STUCK_YIELDS) {
+				return -1;
+			}
+			if (stuck >= STUCK_SPINS) {
+				sched_yield();
+			}
+			continue;
+		}
+
+		if (info) {
+			memcpy(info, slot, shm->imageOffset < sizeof(*info) ? shm->imageOffset : sizeof(*info));
+		}
+
+		len = slot->image_len;
+		if (len > max_len) len = max_len;
+		if (len < 0) len = 0;
+		if (image && len > 0) {
+			memcpy(image, image_of(shm, slot), len * sizeof(unsigned short));
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		end = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+		if (begin == end) break;
+	}
+
+	if (info) {
+		info->sequence = begin;
+	}
+
+	return image ? len : 0;
+}
@@ -0,0 +1,198 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "modbus_tcp_client.h"
+#include "modbus_tcp_private.h"
+
+/*
+ * Fleet snapshots
+ *
+ * Everything a snapshot needs is allocated at create : the matrix, the
+ * results and one transaction per device reading straight into its row.
+ * Taking a snapshot prepares all transactions first and then submits them
+ * in one pass, so the requests leave within microseconds of each other (with
+ * io_uring in a single submit), and runs the poller until all of them are
+ * done.
+ */
+
+struct modbus_tcp_snapshot {
+	modbus_tcp_poller* poller;
+	int num_of_device;
+	int row_len;
+	modbus_tcp_snapshot_device_t* devices;
+	unsigned char* added;
+	unsigned short* matrix;
+	modbus_tcp_snapshot_result_t* results;
+	modbus_tcp_transaction_t* transactions;
+	int remaining;
+};
+
+static void device_complete(modbus_tcp_transaction_t* t)
+{
+	modbus_tcp_snapshot* snapshot = t->user_data;
+
+	snapshot->remaining--;
+}
+
+static void release(modbus_tcp_snapshot* snapshot)
+{
+	int i;
+
+	if (snapshot->added) {
+		for (i=0; i<snapshot->num_of_device; i++) {
+			if (snapshot->added[i]) {
+				modbus_tcp_poller_remove(snapshot->poller, snapshot->devices[i].client);
+			}
+		}
+	}
+
+	free(snapshot->devices);
+	free(snapshot->added);
+	free(snapshot->matrix);
+	free(snapshot->results);
+	free(snapshot->transactions);
+	free(snapshot);
+}
+
+modbus_tcp_snapshot* modbus_tcp_snapshot_create(modbus_tcp_poller* poller, const modbus_tcp_snapshot_device_t* devices, int num_of_device)
+{
+	struct modbus_tcp_snapshot* snapshot;
+	int image_len;
+	int i;
+
+	if (!poller || !devices || num_of_device <= 0) return NULL;
+
+	snapshot = calloc(1, sizeof(struct modbus_tcp_snapshot));
+	if (!snapshot) return NULL;
+
+	snapshot->poller = poller;
+	snapshot->num_of_device = num_of_device;
+
+	for (i=0; i<num_of_device; i++) {
+		if (!devices[i].client || !devices[i].plan) {
+			free(snapshot);
+			return NULL;
+		}
+		modbus_tcp_poll_plan_image(devices[i].plan, &image_len);
+		if (image_len > snapshot->row_len) {
+			snapshot->row_len = image_len;
+		}
+	}
+
+	snapshot->devices = malloc(num_of_device * sizeof(modbus_tcp_snapshot_device_t));
+	snapshot->added = calloc(num_of_device, 1);
+	snapshot->matrix = calloc((size_t)num_of_device * snapshot->row_len, sizeof(unsigned short));
+	snapshot->results = calloc(num_of_device, sizeof(modbus_tcp_snapshot_result_t));
+	snapshot->transactions = calloc(num_of_device, sizeof(modbus_tcp_transaction_t));
+	if (!snapshot->devices || !snapshot->added || !snapshot->matrix || !snapshot->results || !snapshot->transactions) {
+		release(snapshot);
+		return NULL;
+	}
+	memcpy(snapshot->devices, devices, num_of_device * sizeof(modbus_tcp_snapshot_device_t));
+
+	for (i=0; i<num_of_device; i++) {
+		modbus_tcp_client* client = devices[i].client;
+
+		if (client->poller == poller) continue;
+
+		if (client->poller || modbus_tcp_poller_add(poller, client) < 0) {
+			release(snapshot);
+			return NULL;
+		}
+		snapshot->added[i] = 1;
+	}
+
+	return snapshot;
+}
+
+void modbus_tcp_snapshot_destroy(modbus_tcp_snapshot* snapshot)
+{
+	if (!snapshot) return;
+
+	release(snapshot);
+}
+
+int modbus_tcp_snapshot_take(modbus_tcp_snapshot* snapshot, unsigned short timeout_msec)
+{
+	struct timespec realtime;
+	unsigned long long monotonic_usec;
+	int num_of_read = 0;
+	int failed = 0;
+	int i;
+
+	for (i=0; i<snapshot->num_of_device; i++) {
+		modbus_tcp_transaction_t* t = &snapshot->transactions[i];
+
+		modbus_tcp_prepare_poll_plan(t, snapshot->devices[i].client, snapshot->devices[i].plan, snapshot->matrix + (size_t)i * snapshot->row_len);
+		t->timeout_msec = timeout_msec;
+		t->complete = device_complete;
+		t->user_data = snapshot;
+	}
+
+	snapshot->remaining = snapshot->num_of_device;
+	for (i=0; i<snapshot->num_of_device; i++) {
+		modbus_tcp_transaction_t* t = &snapshot->transactions[i];
+
+		/* a client taken off the poller since create */
+		if (modbus_tcp_poller_submit(snapshot->poller, t) < 0) {
+			t->result = MODBUS_TCP_ERROR;
+			snapshot->remaining--;
+		}
+	}
+
+	while (snapshot->remaining > 0) {
+		if (modbus_tcp_poller_run(snapshot->poller, -1) < 0) {
+			/* nothing may stay queued on the poller once take returns, the transactions are ours */
+			for (i=0; i<snapshot->num_of_device; i++) {
+				modbus_tcp_poller_cancel(snapshot->poller, &snapshot->transactions[i]);
+			}
+			failed = 1;
+			break;
+		}
+	}
+
+	/* the receive times are taken on the monotonic clock, one reading of both clocks maps them */
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	monotonic_usec = modbus_tcp_monotonic_usec();
+
+	for (i=0; i<snapshot->num_of_device; i++) {
+		modbus_tcp_transaction_t* t = &snapshot->transactions[i];
+		modbus_tcp_snapshot_result_t* result = &snapshot->results[i];
+
+		result->status = t->result;
+		result->exception_code = t->exception_code;
+		result->sent_usec = t->sent_usec;
+		result->received_usec = 0;
+		result->received_realtime_nsec = 0;
+
+		if (t->result == MODBUS_TCP_OK || t->result == MODBUS_TCP_EXCEPTION) {
+			result->received_usec = t->completed_usec;
+			result->received_realtime_nsec = (unsigned long long)realtime.tv_sec * 1000000000 + realtime.tv_nsec
+				- (monotonic_usec - t->completed_usec) * 1000;
+		}
+
+		/* a device that was not read must not show the last snapshot's registers */
+		if (t->result == MODBUS_TCP_OK) {
+			num_of_read++;
+		} else {
+			memset(snapshot->matrix + (size_t)i * snapshot->row_len, 0, snapshot->row_len * sizeof(unsigned short));
+		}
+	}
+
+	return failed ? -1 : num_of_read;
+}
+
+const unsigned short* modbus_tcp_snapshot_matrix(modbus_tcp_snapshot* snapshot, int* row_len)
+{
+	if (row_len) {
+		*row_len = snapshot->row_len;
+	}
+
+	return snapshot->matrix;
+}
+
+const modbus_tcp_snapshot_result_t* modbus_tcp_snapshot_results(modbus_tcp_snapshot* snapshot)
+{
+	return snapshot->results;
+}
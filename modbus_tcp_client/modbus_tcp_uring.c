@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "modbus_tcp_client.h"
+#include "modbus_tcp_private.h"
+
+#ifdef MODBUS_TCP_HAVE_IO_URING
+
+/*
+ * Minimal io_uring ring for the poller, the syscalls are used directly so no
+ * liburing is needed on the gateway images.
+ */
+
+#define BUFFER_GROUP 1
+
+struct modbus_tcp_uring {
+	int fd;
+	unsigned int features;
+
+	void* sqRing;
+	size_t sqRingSize;
+	unsigned int* sqHead;
+	unsigned int* sqTail;
+	unsigned int sqMask;
+	unsigned int sqEntries;
+	unsigned int* sqArray;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned int sqLocalTail;
+
+	void* cqRing;
+	size_t cqRingSize;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int cqMask;
+	struct io_uring_cqe* cqes;
+
+	struct __kernel_timespec timeout;
+
+	/* provided receive buffers, registered with the kernel for multishot recv */
+	int multishot;
+	struct io_uring_buf_ring* bufRing;
+	size_t bufRingSize;
+	unsigned char* buffers;
+	unsigned int bufCount;
+	unsigned int bufSize;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void register_buffers(struct modbus_tcp_uring* ring, unsigned int buf_count, unsigned int buf_size)
+{
+#if defined(IORING_RECV_MULTISHOT)
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	ring->bufRingSize = buf_count * sizeof(struct io_uring_buf);
+	ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufRing == MAP_FAILED) {
+		ring->bufRing = NULL;
+		return;
+	}
+
+	ring->buffers = malloc((size_t)buf_count * buf_size);
+	if (!ring->buffers) {
+		goto do_unmap;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->bufRing;
+	reg.ring_entries = buf_count;
+	reg.bgid = BUFFER_GROUP;
+
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		goto do_free;
+	}
+
+	ring->bufCount = buf_count;
+	ring->bufSize = buf_size;
+	ring->bufRing->tail = 0;
+	for (i=0; i<buf_count; i++) {
+		modbus_tcp_uring_recycle(ring, i);
+	}
+
+	ring->multishot = 1;
+	return;
+
+do_free:
+	free(ring->buffers);
+	ring->buffers = NULL;
+do_unmap:
+	munmap(ring->bufRing, ring->bufRingSize);
+	ring->bufRing = NULL;
+#else
+	(void)ring;
+	(void)buf_count;
+	(void)buf_size;
+#endif
+}
+
+struct modbus_tcp_uring* modbus_tcp_uring_create(unsigned int entries, unsigned int buf_count, unsigned int buf_size)
+{
+	struct modbus_tcp_uring* ring = calloc(1, sizeof(struct modbus_tcp_uring));
+	struct io_uring_params params;
+
+	if (!ring) return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->features = params.features;
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = ring->sqRingSize;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		goto do_close;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			goto do_unmap_sq;
+		}
+	}
+
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		goto do_unmap_cq;
+	}
+
+	ring->sqHead = (unsigned int*)((char*)ring->sqRing + params.sq_off.head);
+	ring->sqTail = (unsigned int*)((char*)ring->sqRing + params.sq_off.tail);
+	ring->sqMask = *(unsigned int*)((char*)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	ring->sqArray = (unsigned int*)((char*)ring->sqRing + params.sq_off.array);
+	ring->sqLocalTail = *ring->sqTail;
+
+	ring->cqHead = (unsigned int*)((char*)ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned int*)((char*)ring->cqRing + params.cq_off.tail);
+	ring->cqMask = *(unsigned int*)((char*)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+
+	register_buffers(ring, buf_count, buf_size);
+
+	return ring;
+
+do_unmap_cq:
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+do_unmap_sq:
+	munmap(ring->sqRing, ring->sqRingSize);
+do_close:
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+void modbus_tcp_uring_destroy(struct modbus_tcp_uring* ring)
+{
+	if (!ring) return;
+
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+
+	if (ring->bufRing) {
+		munmap(ring->bufRing, ring->bufRingSize);
+	}
+	free(ring->buffers);
+	free(ring);
+}
+
+int modbus_tcp_uring_multishot(struct modbus_tcp_uring* ring)
+{
+	return ring->multishot;
+}
+
+void modbus_tcp_uring_disable_multishot(struct modbus_tcp_uring* ring)
+{
+	ring->multishot = 0;
+}
+
+unsigned char* modbus_tcp_uring_buffer(struct modbus_tcp_uring* ring, unsigned int bid)
+{
+	return ring->buffers + (size_t)bid * ring->bufSize;
+}
+
+void modbus_tcp_uring_recycle(struct modbus_tcp_uring* ring, unsigned int bid)
+{
+#if defined(IORING_RECV_MULTISHOT)
+	unsigned short tail = ring->bufRing->tail;
+	struct io_uring_buf* buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+	buf->addr = (unsigned long)modbus_tcp_uring_buffer(ring, bid);
+	buf->len = ring->bufSize;
+	buf->bid = bid;
+
+	__atomic_store_n(&ring->bufRing->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+#else
+	(void)ring;
+	(void)bid;
+#endif
+}
+
+static int submit(struct modbus_tcp_uring* ring, unsigned int wait_nr, int timeout_msec);
+
+/* the next free submission entry, submits the queued ones first when the ring is full */
+struct io_uring_sqe* modbus_tcp_uring_get_sqe(struct modbus_tcp_uring* ring)
+{
+	struct io_uring_sqe* sqe;
+	unsigned int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+	if (ring->sqLocalTail - head >= ring->sqEntries) {
+		if (submit(ring, 0, 0) < 0) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+		if (ring->sqLocalTail - head >= ring->sqEntries) {
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[ring->sqLocalTail & ring->sqMask] = ring->sqLocalTail & ring->sqMask;
+	ring->sqLocalTail++;
+
+	return sqe;
+}
+
+static int submit(struct modbus_tcp_uring* ring, unsigned int wait_nr, int timeout_msec)
+{
+	unsigned int to_submit;
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	void* arg = NULL;
+	size_t argsz = 0;
+	int res;
+
+#if defined(IORING_ENTER_EXT_ARG)
+	struct io_uring_getevents_arg ext;
+
+	if (wait_nr && timeout_msec >= 0 && (ring->features & IORING_FEAT_EXT_ARG)) {
+		ring->timeout.tv_sec = timeout_msec / 1000;
+		ring->timeout.tv_nsec = (long long)(timeout_msec % 1000) * 1000000;
+		memset(&ext, 0, sizeof(ext));
+		ext.ts = (unsigned long)&ring->timeout;
+		flags |= IORING_ENTER_EXT_ARG;
+		arg = &ext;
+		argsz = sizeof(ext);
+		timeout_msec = -1;
+	}
+#endif
+
+	/* older kernels : a timeout entry that also ends at the first completion */
+	if (wait_nr && timeout_msec >= 0) {
+		struct io_uring_sqe* sqe;
+
+		if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+			wait_nr = 0;
+		} else {
+			sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+			memset(sqe, 0, sizeof(*sqe));
+			ring->sqArray[ring->sqLocalTail & ring->sqMask] = ring->sqLocalTail & ring->sqMask;
+			ring->sqLocalTail++;
+
+			ring->timeout.tv_sec = timeout_msec / 1000;
+			ring->timeout.tv_nsec = (long long)(timeout_msec % 1000) * 1000000;
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = (unsigned long)&ring->timeout;
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = 0;
+		}
+	}
+
+	to_submit = ring->sqLocalTail - *ring->sqTail;
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+
+	res = uring_enter(ring->fd, to_submit, wait_nr, flags, arg, argsz);
+	if (res < 0 && (errno == EINTR || errno == ETIME || errno == EBUSY)) {
+		return 0;
+	}
+
+	return res;
+}
+
+int modbus_tcp_uring_submit_and_wait(struct modbus_tcp_uring* ring, int timeout_msec)
+{
+	return submit(ring, timeout_msec == 0 ? 0 : 1, timeout_msec);
+}
+
+/* hands every posted completion to handle, returns how many there were */
+int modbus_tcp_uring_reap(struct modbus_tcp_uring* ring, void (*handle)(void* arg, struct io_uring_cqe* cqe), void* arg)
+{
+	unsigned int head = *ring->cqHead;
+	unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+
+		head++;
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+		if (cqe.user_data) {
+			handle(arg, &cqe);
+		}
+		count++;
+
+		if (head == tail) {
+			tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	return count;
+}
+
+#endif